@@ -0,0 +1,227 @@
+/*
+ * bench-dbuf.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "dbuf/dbuf.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t total = 16;  /* MiB */
+
+struct result {
+    unsigned long ops;
+    unsigned long grows;   /* Times that the allocation changed. */
+    size_t alloc;          /* Final allocation of the last buffer. */
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void
+countgrow(struct result *r, const struct dbuf *b, size_t *alloc)
+{
+    if (b->alloc != *alloc) {
+        *alloc = b->alloc;
+        r->grows++;
+    }
+}
+
+/* Appends one byte at a time to a single large buffer. */
+static void
+bench_addch(struct result *r)
+{
+    struct dbuf b = DBUF_INIT;
+    size_t alloc = 0;
+
+    for (size_t i = 0; i < total * 1024 * 1024; i++) {
+        dbuf_addch(&b, 'x');
+        countgrow(r, &b, &alloc);
+    }
+
+    r->ops = dbuf_size(&b);
+    r->alloc = b.alloc;
+    dbuf_clear(&b);
+}
+
+/* Appends chunks of varying sizes, as when assembling a message. */
+static void
+bench_addmem(struct result *r)
+{
+    static char chunk[4096];
+    struct dbuf b = DBUF_INIT;
+    size_t alloc = 0;
+    unsigned seed = 1;
+
+    while (dbuf_size(&b) < total * 1024 * 1024) {
+        seed = seed * 1103515245 + 12345;
+        dbuf_addmem(&b, chunk, 1 + (seed >> 16) % sizeof(chunk));
+        countgrow(r, &b, &alloc);
+        r->ops++;
+    }
+
+    r->alloc = b.alloc;
+    dbuf_clear(&b);
+}
+
+/* Formats numbers into a single buffer. */
+static void
+bench_addfmt(struct result *r)
+{
+    struct dbuf b = DBUF_INIT;
+    size_t alloc = 0;
+
+    for (unsigned i = 0; dbuf_size(&b) < total * 1024 * 1024; i++) {
+        dbuf_addfmt(&b, "%u, ", i);
+        countgrow(r, &b, &alloc);
+        r->ops++;
+    }
+
+    r->alloc = b.alloc;
+    dbuf_clear(&b);
+}
+
+/* Builds many short-lived small strings, e.g. headers or keys. */
+static void
+bench_small(struct result *r, bool storage)
+{
+    static const char *words[] = { "Host", ": ", "example.com", "\r\n" };
+    const unsigned long count = total * 1024 * 64;
+
+    for (unsigned long i = 0; i < count; i++) {
+        uint8_t inl[64];
+        struct dbuf b = storage ? DBUF_INIT_STORAGE(inl) : DBUF_INIT;
+        size_t alloc = b.alloc;
+
+        for (unsigned j = 0; j < sizeof(words) / sizeof(words[0]); j++) {
+            dbuf_addstr(&b, words[j]);
+            countgrow(r, &b, &alloc);
+        }
+
+        r->alloc = b.alloc;
+        dbuf_clear(&b);
+    }
+
+    r->ops = count;
+}
+
+static void
+bench_small_heap(struct result *r)
+{
+    bench_small(r, false);
+}
+
+static void
+bench_small_storage(struct result *r)
+{
+    bench_small(r, true);
+}
+
+/* Moves data through a pipe with dbuf_writefd() and dbuf_readfd(). */
+static void
+bench_fdio(struct result *r)
+{
+    int fds[2];
+    if (pipe(fds) == -1 ||
+        fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1) {
+        fprintf(stderr, "Cannot create pipe: %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    static char chunk[16 * 1024];
+    struct dbuf out = DBUF_INIT, in = DBUF_INIT;
+    size_t offset = 0, alloc = 0, moved = 0;
+
+    while (moved < total * 1024 * 1024) {
+        if (dbuf_size(&out) - offset < sizeof(chunk))
+            dbuf_addmem(&out, chunk, sizeof(chunk));
+        if (dbuf_writefd(&out, fds[1], &offset) == -1 && errno != EAGAIN) {
+            fprintf(stderr, "Write failed: %s.\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        ssize_t n;
+        while ((n = dbuf_readfd(&in, fds[0], 0)) > 0) {
+            moved += n;
+            dbuf_clear(&in);
+            r->ops++;
+        }
+        countgrow(r, &out, &alloc);
+    }
+
+    r->alloc = out.alloc;
+    dbuf_clear(&out);
+    dbuf_clear(&in);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(struct result*);
+} benches[] = {
+    { "addch",         bench_addch         },
+    { "addmem",        bench_addmem        },
+    { "addfmt",        bench_addfmt        },
+    { "small-heap",    bench_small_heap    },
+    { "small-storage", bench_small_storage },
+    { "fdio",          bench_fdio          },
+};
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+            case 's':
+                total = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s MiB] [name...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!total) {
+        fprintf(stderr, "Invalid arguments.\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-14s %12s %10s %12s %10s\n", "pattern", "ops", "ns/op", "grows", "alloc");
+
+    for (unsigned i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (optind < argc) {
+            bool selected = false;
+            for (int j = optind; j < argc; j++)
+                selected |= !strcmp(argv[j], benches[i].name);
+            if (!selected)
+                continue;
+        }
+
+        struct result r = { 0 };
+        const double start = now();
+        benches[i].run(&r);
+        const double secs = now() - start;
+
+        printf("%-14s %12lu %10.2f %12lu %10zu\n", benches[i].name, r.ops,
+               secs * 1e9 / r.ops, r.grows, r.alloc);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,205 @@
+/*
+ * bench-netring.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "netdial.h"
+#include "netring.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static unsigned nclients = 8;
+static unsigned msgsize = 64;
+static unsigned duration = 2;  /* seconds */
+
+static atomic_bool running;
+static atomic_ulong roundtrips;
+
+/* Avoid measuring Nagle and delayed ACK interactions. */
+static void
+nodelay(int fd)
+{
+    const int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+static void
+handle_sent(struct netring *ring, int fd, ssize_t len, void *data)
+{
+    (void) ring;
+    (void) fd;
+    (void) len;
+    free(data);
+}
+
+static void
+handle_recv(struct netring *ring, int fd, const void *buf, ssize_t len, void *data)
+{
+    (void) data;
+
+    if (len <= 0) {
+        netring_cancel(ring, fd);
+        nethangup(fd, NDclose);
+        return;
+    }
+
+    /* Received data is only valid during the callback, keep a copy. */
+    void *copy = malloc(len);
+    memcpy(copy, buf, len);
+
+    const struct iovec iov = { .iov_base = copy, .iov_len = len };
+    if (netring_send(ring, fd, &iov, 1, handle_sent, copy) == -1)
+        free(copy);
+}
+
+static void
+handle_accept(struct netring *ring, int fd, void *data)
+{
+    (void) data;
+
+    if (fd < 0)
+        return;
+
+    nodelay(fd);
+    if (netring_recv(ring, fd, handle_recv, NULL) == -1)
+        nethangup(fd, NDclose);
+}
+
+static void*
+run_server(void *data)
+{
+    netring_run(data);
+    return NULL;
+}
+
+static void*
+run_client(void *data)
+{
+    const char *address = data;
+
+    int fd = netdial(address, NDblocking);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot connect to %s: %s.\n", address, strerror(errno));
+        return NULL;
+    }
+    nodelay(fd);
+
+    uint8_t buf[msgsize];
+    memset(buf, 'x', msgsize);
+
+    unsigned long n = 0;
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (write(fd, buf, msgsize) != (ssize_t) msgsize)
+            break;
+
+        for (size_t got = 0; got < msgsize;) {
+            const ssize_t r = read(fd, buf + got, msgsize - got);
+            if (r <= 0)
+                goto beach;
+            got += r;
+        }
+        n++;
+    }
+
+beach:
+    atomic_fetch_add(&roundtrips, n);
+    nethangup(fd, NDclose);
+    return NULL;
+}
+
+static int
+bench(int flags)
+{
+    struct netring *ring = netring_new(flags);
+    if (!ring) {
+        fprintf(stderr, "Cannot create ring: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    int fd = netannounce("tcp4:127.0.0.1:0", NDdefault, 1024);
+    char address[NDaddrmax];
+    if (fd == -1 || netaddress_r(fd, NDlocal, address, sizeof(address)) == -1) {
+        fprintf(stderr, "Cannot listen: %s.\n", strerror(errno));
+        netring_free(ring);
+        return -1;
+    }
+
+    netring_accept(ring, fd, NDdefault, handle_accept, NULL);
+
+    pthread_t server;
+    pthread_create(&server, NULL, run_server, ring);
+
+    atomic_store(&running, true);
+    atomic_store(&roundtrips, 0);
+
+    pthread_t clients[nclients];
+    for (unsigned i = 0; i < nclients; i++)
+        pthread_create(&clients[i], NULL, run_client, address);
+
+    sleep(duration);
+    atomic_store(&running, false);
+
+    for (unsigned i = 0; i < nclients; i++)
+        pthread_join(clients[i], NULL);
+
+    netring_stop(ring);
+    pthread_join(server, NULL);
+
+    const unsigned long n = atomic_load(&roundtrips);
+    printf("%-8s  %10.0f roundtrips/s  %8.2f MiB/s\n",
+           netring_backend(ring), (double) n / duration,
+           (double) n * msgsize * 2 / duration / (1024 * 1024));
+
+    netring_free(ring);
+    nethangup(fd, NDclose);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:t:")) != -1) {
+        switch (opt) {
+            case 'c':
+                nclients = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                msgsize = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                duration = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-s msgsize] [-t seconds]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!nclients || !msgsize || !duration) {
+        fprintf(stderr, "Invalid arguments.\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%u clients, %u byte messages, %u seconds\n", nclients, msgsize, duration);
+
+    if (bench(NRdefault) == -1 || bench(NRepoll) == -1)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
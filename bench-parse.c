@@ -0,0 +1,279 @@
+/*
+ * bench-parse.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+/*
+ * Includes the implementation directly, to measure its static functions in
+ * isolation: cc -O2 -o bench-parse bench-parse.c
+ */
+#include "netdial.c"
+
+#if defined(__GLIBC__)
+/* The GNU libc supports replacing malloc(), which allows counting calls. */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void*, size_t);
+extern void __libc_free(void*);
+
+static unsigned long nallocs;
+
+void*
+malloc(size_t size)
+{
+    nallocs++;
+    return __libc_malloc(size);
+}
+
+void*
+calloc(size_t n, size_t size)
+{
+    nallocs++;
+    return __libc_calloc(n, size);
+}
+
+void*
+realloc(void *ptr, size_t size)
+{
+    nallocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+    __libc_free(ptr);
+}
+# define HAVE_ALLOC_COUNT 1
+#else
+static unsigned long nallocs;
+# define HAVE_ALLOC_COUNT 0
+#endif /* __GLIBC__ */
+
+enum {
+    NCORPUS = 1024,
+};
+
+static unsigned rounds = 1000;
+static volatile int sink;  /* Keeps results alive. */
+
+static char *corpus[NCORPUS];
+static struct sockaddr_storage sacorpus[NCORPUS];
+static socklen_t salens[NCORPUS];
+static int socktypes[NCORPUS];
+static struct netaddr na;
+static int benchfd = -1;
+
+static unsigned long seed = 42;
+
+static unsigned
+rnd(unsigned n)
+{
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (unsigned) (seed >> 33) % n;
+}
+
+static const char *hostnames[] = {
+    "localhost", "example.com", "www.example.org", "api.internal.corp",
+    "db-primary-3.eu-west-1.compute.internal", "cache.local",
+};
+
+static const char *services[] = {
+    "http", "https", "domain", "ssh", "imaps", "submission",
+};
+
+static const char *options[] = {
+    "nodelay", "rcvbuf=4M&sndbuf=1M", "usertimeout=5000", "nodelay&quickack",
+};
+
+static const char *types[] = {
+    "tcp", "udp", "tcp4", "udp4", "tcp6", "udp6", "unix", "unixp",
+    "TCP", "Udp6", "UNIX",
+};
+
+/* Mix of the address kinds found in configuration files and accept logs. */
+static char*
+mkaddress(unsigned i)
+{
+    char buf[NDaddrmax];
+
+    switch (i % 8) {
+        case 0:
+        case 1:
+            snprintf(buf, sizeof(buf), "tcp4:%u.%u.%u.%u:%u", 10 + rnd(200),
+                     rnd(256), rnd(256), 1 + rnd(254), 1024 + rnd(60000));
+            break;
+        case 2:
+            snprintf(buf, sizeof(buf), "tcp:[2001:db8:%x::%x]:%u", rnd(0x10000),
+                     1 + rnd(0xffff), 1 + rnd(65535));
+            break;
+        case 3:
+            snprintf(buf, sizeof(buf), "udp6:[fe80::%x:%x%%%u]:%u", rnd(0x10000),
+                     rnd(0x10000), 1 + rnd(8), 1 + rnd(65535));
+            break;
+        case 4:
+            snprintf(buf, sizeof(buf), "unix:/run/user/%u/service-%u.sock",
+                     1000 + rnd(10), rnd(100));
+            break;
+        case 5:
+            snprintf(buf, sizeof(buf), "tcp:%s:%s", hostnames[rnd(nelem(hostnames))],
+                     services[rnd(nelem(services))]);
+            break;
+        case 6:
+            snprintf(buf, sizeof(buf), "tcp:%s:%u?%s", hostnames[rnd(nelem(hostnames))],
+                     1 + rnd(65535), options[rnd(nelem(options))]);
+            break;
+        case 7:
+            snprintf(buf, sizeof(buf), "udp:%u.%u.%u.%u:domain", 192, 168,
+                     rnd(256), 1 + rnd(254));
+            break;
+    }
+
+    return strdup(buf);
+}
+
+static void
+mkcorpus(void)
+{
+    for (unsigned i = 0; i < NCORPUS; i++) {
+        corpus[i] = mkaddress(i);
+
+        /* Socket addresses for the formatting functions. */
+        struct netaddr pna;
+        if (netaddrparse(corpus[i], &pna) && pna.numeric) {
+            memcpy(&sacorpus[i], &pna.sa, pna.ai.ai_addrlen);
+            salens[i] = pna.ai.ai_addrlen;
+        } else {
+            struct sockaddr_un *sun = (struct sockaddr_un*) &sacorpus[i];
+            sun->sun_family = AF_UNIX;
+            snprintf(sun->sun_path, sizeof(sun->sun_path), "/run/netbench-%u.sock", i);
+            salens[i] = offsetof(struct sockaddr_un, sun_path) + strlen(sun->sun_path) + 1;
+            pna.socktype = SOCK_STREAM;
+        }
+        socktypes[i] = pna.socktype;
+    }
+}
+
+static void
+bench_getnettype(unsigned i)
+{
+    const char *name = types[i % nelem(types)];
+    int family, socktype;
+    sink += getnettype(name, strlen(name), &family, &socktype);
+}
+
+static void
+bench_netaddrparse(unsigned i)
+{
+    sink += netaddrparse(corpus[i], &na);
+}
+
+static void
+bench_fmtnetaddr(unsigned i)
+{
+    char buf[NDaddrmax];
+    sink += fmtnetaddr(buf, sizeof(buf), &sacorpus[i], salens[i], socktypes[i]);
+}
+
+static void
+bench_mknetaddr(unsigned i)
+{
+    char *s = mknetaddr(benchfd, &sacorpus[i], salens[i]);
+    sink += !!s;
+    free(s);
+}
+
+static void
+bench_applyflags(unsigned i)
+{
+    static const int flags[] = {
+        NDdefault, NDkeepalive, NDreuseaddr | NDreuseport, NDkeepalive | NDreuseaddr,
+    };
+    sink += applyflags(benchfd, flags[i % nelem(flags)]);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(unsigned);
+} benches[] = {
+    { "getnettype",   bench_getnettype   },
+    { "netaddrparse", bench_netaddrparse },
+    { "fmtnetaddr",   bench_fmtnetaddr   },
+    { "mknetaddr",    bench_mknetaddr    },
+    { "applyflags",   bench_applyflags   },
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                rounds = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n rounds] [name...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!rounds) {
+        fprintf(stderr, "Invalid arguments.\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((benchfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        fprintf(stderr, "Cannot create socket: %s.\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    mkcorpus();
+
+    printf("%-14s %12s %10s %12s\n", "function", "ops", "ns/op", "allocs/op");
+
+    for (unsigned b = 0; b < nelem(benches); b++) {
+        if (optind < argc) {
+            bool selected = false;
+            for (int j = optind; j < argc; j++)
+                selected |= !strcmp(argv[j], benches[b].name);
+            if (!selected)
+                continue;
+        }
+
+        /* Warm up caches and branch predictors with a pass over the corpus. */
+        for (unsigned i = 0; i < NCORPUS; i++)
+            (*benches[b].run)(i);
+
+        const unsigned long allocs = nallocs;
+        const double start = now();
+        for (unsigned r = 0; r < rounds; r++)
+            for (unsigned i = 0; i < NCORPUS; i++)
+                (*benches[b].run)(i);
+        const double secs = now() - start;
+
+        const double ops = (double) rounds * NCORPUS;
+        if (HAVE_ALLOC_COUNT) {
+            printf("%-14s %12.0f %10.2f %12.2f\n", benches[b].name, ops,
+                   secs * 1e9 / ops, (nallocs - allocs) / ops);
+        } else {
+            printf("%-14s %12.0f %10.2f %12s\n", benches[b].name, ops,
+                   secs * 1e9 / ops, "-");
+        }
+    }
+
+    close(benchfd);
+    for (unsigned i = 0; i < NCORPUS; i++)
+        free(corpus[i]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,255 @@
+/*
+ * bench-relay.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "netdial.h"
+#include "netio.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+    BUFSIZE = 64 * 1024,
+};
+
+static size_t total = 1024;  /* MiB */
+static size_t pipesize = 0;
+
+static char sinkaddr[NDaddrmax];
+static bool copy;
+static double proxycpu;  /* Seconds of CPU time used by the relay. */
+
+static int
+waitfor(int fd, short events)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    return poll(&pfd, 1, -1);
+}
+
+static int
+acceptone(int fd)
+{
+    int nfd;
+    while ((nfd = netaccept(fd, NDdefault, NULL)) == -1 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK))
+        waitfor(fd, POLLIN);
+    return nfd;
+}
+
+static void*
+run_sink(void *data)
+{
+    const int fd = acceptone(*(int*) data);
+    if (fd == -1)
+        return NULL;
+
+    static char buf[BUFSIZE];
+    for (;;) {
+        const ssize_t r = read(fd, buf, sizeof(buf));
+        if (r == 0)
+            break;
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                waitfor(fd, POLLIN);
+            else if (errno != EINTR)
+                break;
+        }
+    }
+
+    nethangup(fd, NDclose);
+    return NULL;
+}
+
+struct copydir {
+    int in, out;
+    size_t len, off;
+    bool done;
+    char buf[BUFSIZE];
+};
+
+/* Relays data between sockets copying through user space, for comparison. */
+static int
+copyrelay(int fda, int fdb)
+{
+    static struct copydir dir[2];
+    dir[0] = (struct copydir) { .in = fda, .out = fdb };
+    dir[1] = (struct copydir) { .in = fdb, .out = fda };
+
+    while (!dir[0].done || !dir[1].done) {
+        struct pollfd pfd[2] = { { .fd = fda }, { .fd = fdb } };
+
+        for (unsigned i = 0; i < 2; i++) {
+            struct copydir *d = &dir[i];
+            while (!d->done) {
+                if (d->off < d->len) {
+                    const ssize_t w = write(d->out, d->buf + d->off, d->len - d->off);
+                    if (w == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                            return -1;
+                        pfd[d->out == fdb].events |= POLLOUT;
+                        break;
+                    }
+                    d->off += w;
+                    continue;
+                }
+
+                const ssize_t r = read(d->in, d->buf, sizeof(d->buf));
+                if (r == -1) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        return -1;
+                    pfd[d->in == fdb].events |= POLLIN;
+                    break;
+                }
+                if (r == 0) {
+                    nethangup(d->out, NDwrite);
+                    d->done = true;
+                    break;
+                }
+                d->len = r;
+                d->off = 0;
+            }
+        }
+
+        if (!dir[0].done || !dir[1].done)
+            poll(pfd, 2, -1);
+    }
+
+    return 0;
+}
+
+static void*
+run_proxy(void *data)
+{
+    const int fda = acceptone(*(int*) data);
+    const int fdb = netdialtimeout(sinkaddr, NDdefault, 1000);
+    if (fda == -1 || fdb == -1) {
+        fprintf(stderr, "Cannot connect proxy: %s.\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+    const int r = copy ? copyrelay(fda, fdb) : netrelay(fda, fdb, pipesize);
+    if (r == -1)
+        fprintf(stderr, "Relay failed: %s.\n", strerror(errno));
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    proxycpu = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    nethangup(fda, NDclose);
+    nethangup(fdb, NDclose);
+    return NULL;
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int
+bench(void)
+{
+    char proxyaddr[NDaddrmax];
+    int sinkfd = netannounce("tcp4:127.0.0.1:0", NDdefault, 1);
+    int proxyfd = netannounce("tcp4:127.0.0.1:0", NDdefault, 1);
+    if (sinkfd == -1 || netaddress_r(sinkfd, NDlocal, sinkaddr, sizeof(sinkaddr)) == -1 ||
+        proxyfd == -1 || netaddress_r(proxyfd, NDlocal, proxyaddr, sizeof(proxyaddr)) == -1) {
+        fprintf(stderr, "Cannot listen: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    pthread_t sink, proxy;
+    pthread_create(&sink, NULL, run_sink, &sinkfd);
+    pthread_create(&proxy, NULL, run_proxy, &proxyfd);
+
+    const int fd = netdial(proxyaddr, NDblocking);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot connect to %s: %s.\n", proxyaddr, strerror(errno));
+        return -1;
+    }
+
+    static char buf[BUFSIZE];
+    memset(buf, 'x', sizeof(buf));
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t left = total * 1024 * 1024; left;) {
+        const ssize_t w = write(fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+        if (w == -1) {
+            fprintf(stderr, "Write failed: %s.\n", strerror(errno));
+            return -1;
+        }
+        left -= w;
+    }
+
+    /* The relay closes the connection once the sink is done reading. */
+    nethangup(fd, NDwrite);
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    const double secs = elapsed(&start);
+
+    pthread_join(proxy, NULL);
+    pthread_join(sink, NULL);
+
+    printf("%-6s  %8.2f MiB/s  %6.3f s relay CPU time  (%.0f%% busy)\n",
+           copy ? "copy" : "splice", total / secs, proxycpu, 100 * proxycpu / secs);
+    nethangup(fd, NDclose);
+    nethangup(proxyfd, NDclose);
+    nethangup(sinkfd, NDclose);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:")) != -1) {
+        switch (opt) {
+            case 'p':
+                pipesize = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                total = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s MiB] [-p pipesize]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!total) {
+        fprintf(stderr, "Invalid arguments.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (pipesize)
+        printf("%zu MiB relayed, %zu byte pipes\n", total, pipesize);
+    else
+        printf("%zu MiB relayed, default pipes\n", total);
+
+    if (bench() == -1)
+        return EXIT_FAILURE;
+
+    copy = true;
+    if (bench() == -1)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
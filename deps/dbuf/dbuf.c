@@ -6,12 +6,15 @@
  */
 
 #include "dbuf.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 enum {
-    CHUNKSIZE = 512,  /* bytes */
+    MINALLOC = 64,    /* bytes */
+    READSIZE = 4096,  /* bytes */
 };
 
 /* Wraps malloc(), realloc(), and free(). */
@@ -27,30 +30,59 @@ mrealloc(void *ptr, size_t size)
     return ptr;
 }
 
-/* Reallocates a buffer and sets the .alloc member. */
+/*
+ * Ensures there is room for at least "size" bytes plus a terminator, and
+ * sets the .alloc member. The allocation doubles each time, which keeps
+ * appending amortized O(1). Data in caller storage is moved to the heap.
+ */
 static inline void
 brealloc(struct dbuf *b, size_t size)
 {
-    if (size) {
-        const size_t new_size = CHUNKSIZE * ((size / CHUNKSIZE) + 1) + 1;
-        assert(new_size >= size);
-        if (new_size != b->alloc)
-            b->data = mrealloc(b->data, (b->alloc = new_size));
-    } else if (b->data) {
-        free(b->data);
-        b->data = NULL;
-        b->alloc = 0;
+    if (size < b->alloc)
+        return;
+
+    size_t new_size = (b->alloc > MINALLOC) ? b->alloc : MINALLOC;
+    while (new_size <= size) {
+        if (new_size > SIZE_MAX / 2) {
+            assert(size < SIZE_MAX);
+            new_size = size + 1;
+            break;
+        }
+        new_size *= 2;
+    }
+
+    if (b->data && b->data == b->storage) {
+        uint8_t *data = mrealloc(NULL, new_size);
+        memcpy(data, b->data, b->size);
+        b->data = data;
     } else {
-        assert(b->alloc == 0);
+        b->data = mrealloc(b->data, new_size);
     }
+    b->alloc = new_size;
+}
+
+/* Frees heap memory, going back to the caller storage, if any. */
+static inline void
+brelease(struct dbuf *b)
+{
+    if (b->data != b->storage)
+        mrealloc(b->data, 0);
+
+    b->data = b->storage;
+    b->alloc = b->storage_size;
+    b->size = 0;
 }
 
 /* Calls brealloc() and sets the .size member. */
 static inline void
 bresize(struct dbuf *b, size_t size)
 {
-    brealloc(b, size);
-    b->size = size;
+    if (size) {
+        brealloc(b, size);
+        b->size = size;
+    } else {
+        brelease(b);
+    }
 }
 
 struct dbuf*
@@ -58,7 +90,8 @@ dbuf_new(size_t prealloc)
 {
     struct dbuf *b = mrealloc(NULL, sizeof(struct dbuf));
     *b = DBUF_INIT;
-    bresize(b, prealloc);
+    if (prealloc)
+        brealloc(b, prealloc);
     return b;
 }
 
@@ -70,6 +103,18 @@ dbuf_free(struct dbuf *b)
     mrealloc(b, 0);
 }
 
+void
+dbuf_init(struct dbuf *b, void *storage, size_t size)
+{
+    assert(b);
+
+    *b = DBUF_INIT;
+    if (storage && size) {
+        b->data = b->storage = storage;
+        b->alloc = b->storage_size = size;
+    }
+}
+
 void
 dbuf_resize(struct dbuf *b, size_t size)
 {
@@ -77,6 +122,14 @@ dbuf_resize(struct dbuf *b, size_t size)
     bresize(b, size);
 }
 
+void
+dbuf_reserve(struct dbuf *b, size_t size)
+{
+    assert(b);
+    assert(size <= SIZE_MAX - b->size);
+    brealloc(b, b->size + size);
+}
+
 void
 dbuf_clear(struct dbuf *b)
 {
@@ -90,9 +143,9 @@ dbuf_addmem(struct dbuf *b, const void *data, size_t size)
     assert(b);
     assert(data);
 
-    const size_t bsize = b->size;
-    bresize(b, bsize + size);
-    memcpy(b->data + bsize, data, size);
+    brealloc(b, b->size + size);
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
 }
 
 void
@@ -101,10 +154,7 @@ dbuf_addstr(struct dbuf *b, const char *s)
     assert(b);
     assert(s);
 
-    const size_t bsize = b->size;
-    const size_t slen = strlen(s);
-    bresize(b, bsize + slen);
-    memcpy(b->data + bsize, s, slen);
+    dbuf_addmem(b, s, strlen(s));
 }
 
 void
@@ -116,17 +166,18 @@ dbuf_addfmtv(struct dbuf *b, const char *format, va_list args)
     va_list saved;
     va_copy(saved, args);
 
-    const size_t available = (b->alloc - b->size);
-    const size_t needed = available
-        ? vsnprintf((char*) b->data + b->size, available - 1, format, args)
-        : vsnprintf(NULL, 0, format, args);
+    const size_t available = b->alloc - b->size;
+    const int needed = vsnprintf(available ? (char*) b->data + b->size : NULL,
+                                 available, format, args);
 
-    if (needed >= available) {
-        brealloc(b, b->alloc + needed);
-        vsnprintf((char*) b->data + b->size, b->alloc - 1, format, saved);
+    if (needed >= 0) {
+        if ((size_t) needed >= available) {
+            brealloc(b, b->size + needed);
+            vsnprintf((char*) b->data + b->size, b->alloc - b->size, format, saved);
+        }
+        b->size += needed;
     }
 
-    b->size += needed;
     va_end(saved);
 }
 
@@ -135,9 +186,58 @@ dbuf_str(struct dbuf *b)
 {
     assert(b);
 
-    if (!b->alloc)
-        brealloc(b, 1);
-
+    brealloc(b, b->size);
     b->data[b->size] = '\0';
     return (char*) b->data;
 }
+
+ssize_t
+dbuf_readfd(struct dbuf *b, int fd, size_t size)
+{
+    assert(b);
+
+    brealloc(b, b->size + (size ? size : READSIZE));
+
+    /* Read into all the spare room, which may be more than requested. */
+    ssize_t r;
+    do {
+        r = read(fd, b->data + b->size, b->alloc - b->size - 1);
+    } while (r == -1 && errno == EINTR);
+
+    if (r > 0)
+        b->size += r;
+    return r;
+}
+
+ssize_t
+dbuf_writefd(struct dbuf *b, int fd, size_t *offset)
+{
+    assert(b);
+    assert(offset);
+    assert(*offset <= b->size);
+
+    const size_t start = *offset;
+    while (*offset < b->size) {
+        const ssize_t w = write(fd, b->data + *offset, b->size - *offset);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            if (*offset == start)
+                return -1;
+            break;  /* Report the partial progress. */
+        }
+        *offset += w;
+    }
+
+    const size_t done = *offset - start;
+    if (*offset == b->size) {
+        /* Drained: keep the memory around for reuse. */
+        b->size = *offset = 0;
+    } else if (*offset >= b->size / 2) {
+        /* Compact, moving at most as many bytes as were already written. */
+        b->size -= *offset;
+        memmove(b->data, b->data + *offset, b->size);
+        *offset = 0;
+    }
+    return done;
+}
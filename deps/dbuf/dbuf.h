@@ -13,6 +13,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 #if !(defined(__GNUC__) && __GNUC__ >= 3) && !defined(__attribute__)
 # define __attribute__(dummy)
@@ -22,19 +23,31 @@ struct dbuf {
     uint8_t *data;
     size_t   size;
     size_t   alloc;
+    uint8_t *storage;  /* Caller provided storage, used until it fills up. */
+    size_t   storage_size;
 };
 
 #define DBUF_INIT  ((struct dbuf) { .data = NULL, .size = 0, .alloc = 0 })
 
+#define DBUF_INIT_STORAGE(_buf) \
+    ((struct dbuf) { .data = (uint8_t*) (_buf), .size = 0, .alloc = sizeof(_buf), \
+                     .storage = (uint8_t*) (_buf), .storage_size = sizeof(_buf) })
+
 struct dbuf* dbuf_new(size_t prealloc)
     __attribute__((warn_unused_result));
 
 void dbuf_free(struct dbuf*)
     __attribute__((nonnull(1)));
 
+void dbuf_init(struct dbuf*, void*, size_t)
+    __attribute__((nonnull(1)));
+
 void dbuf_resize(struct dbuf*, size_t)
     __attribute__((nonnull(1)));
 
+void dbuf_reserve(struct dbuf*, size_t)
+    __attribute__((nonnull(1)));
+
 void dbuf_clear(struct dbuf*)
     __attribute__((nonnull(1)));
 
@@ -51,6 +64,12 @@ char* dbuf_str(struct dbuf*)
     __attribute__((warn_unused_result))
     __attribute__((nonnull(1)));
 
+ssize_t dbuf_readfd(struct dbuf*, int, size_t)
+    __attribute__((nonnull(1)));
+
+ssize_t dbuf_writefd(struct dbuf*, int, size_t*)
+    __attribute__((nonnull(1, 3)));
+
 
 static inline size_t dbuf_size(const struct dbuf*)
     __attribute__((warn_unused_result))
@@ -106,7 +125,12 @@ void
 dbuf_addch(struct dbuf *b, char c)
 {
     assert(b);
-    dbuf_addmem(b, &c, 1);
+
+    /* Fast path: there is room for the character and the terminator. */
+    if (b->size + 1 < b->alloc)
+        b->data[b->size++] = (uint8_t) c;
+    else
+        dbuf_addmem(b, &c, 1);
 }
 
 
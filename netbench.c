@@ -0,0 +1,608 @@
+/*
+ * netbench.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include "netdial.h"
+#include "netloop.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef nelem
+#define nelem(v) (sizeof(v) / sizeof(v[0]))
+#endif /* !nelem */
+
+/*
+ * Log-linear histogram, in the spirit of HdrHistogram: each power of two is
+ * split in HGsub / 2 linear buckets, and reporting the middle of a bucket
+ * keeps the error of the reported values under 1 / HGsub, that is, 0.8%.
+ */
+enum {
+    HGsubbits = 7,
+    HGsub     = 1 << HGsubbits,
+    HGbuckets = (64 - HGsubbits + 1) * (HGsub / 2) + HGsub / 2,
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HGbuckets];
+};
+
+static inline unsigned
+hgindex(uint64_t v)
+{
+    if (v < HGsub)
+        return (unsigned) v;
+
+    const unsigned shift = (63 - __builtin_clzll(v)) - (HGsubbits - 1);
+    return shift * (HGsub / 2) + (unsigned) (v >> shift);
+}
+
+/* Middle of the range of values recorded in a bucket. */
+static inline uint64_t
+hgvalue(unsigned i)
+{
+    if (i < HGsub)
+        return i;
+
+    const unsigned shift = i / (HGsub / 2) - 1;
+    const uint64_t low = (uint64_t) (i - shift * (HGsub / 2)) << shift;
+    return low + ((UINT64_C(1) << shift) >> 1);
+}
+
+static inline void
+hgrecord(struct histogram *h, uint64_t v)
+{
+    h->buckets[hgindex(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void
+hgmerge(struct histogram *h, const struct histogram *o)
+{
+    for (unsigned i = 0; i < HGbuckets; i++)
+        h->buckets[i] += o->buckets[i];
+    h->count += o->count;
+    h->sum += o->sum;
+    if (o->max > h->max)
+        h->max = o->max;
+}
+
+static uint64_t
+hgpercentile(const struct histogram *h, double p)
+{
+    if (!h->count)
+        return 0;
+
+    uint64_t rank = (uint64_t) (p / 100.0 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HGbuckets; i++) {
+        if ((seen += h->buckets[i]) >= rank) {
+            const uint64_t v = hgvalue(i);
+            return (v > h->max) ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+enum mode {
+    Mecho,
+    Mconnect,
+};
+
+static enum mode mode = Mecho;
+static const char *address;
+static unsigned nconns = 64;
+static unsigned nthreads = 1;
+static size_t msgsize = 64;
+static unsigned depth = 1;
+static unsigned duration = 5;  /* seconds */
+static unsigned warmup = 1;    /* seconds */
+static bool json;
+
+enum phase {
+    Pwarmup,
+    Pmeasure,
+    Pdone,
+};
+
+static atomic_int phase;
+
+struct worker {
+    pthread_t thread;
+    struct netloop *loop;
+    unsigned nconns;
+    struct conn *conns;
+
+    uint64_t requests;  /* Completed while measuring. */
+    uint64_t connects;  /* Completed while measuring, connect mode only. */
+    uint64_t connerrors;
+    uint64_t errors;
+    unsigned stalled;  /* Connections which could not start dialing. */
+    struct histogram connlat;
+    struct histogram latency;
+};
+
+struct conn {
+    struct worker *w;
+    int fd;
+    bool stalled;
+    uint64_t dialstart;
+
+    /* Echo mode: send times of the requests in flight, oldest at "head". */
+    uint64_t *sent;
+    unsigned head, inflight;
+    size_t woff;  /* Bytes of the request being written. */
+    size_t roff;  /* Bytes of the response being read. */
+};
+
+static uint8_t *message;
+
+static inline uint64_t
+nowns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline bool
+measuring(void)
+{
+    return atomic_load_explicit(&phase, memory_order_relaxed) == Pmeasure;
+}
+
+static void
+dropconn(struct conn *c)
+{
+    c->w->errors++;
+    netloop_del(c->w->loop, c->fd);
+    nethangup(c->fd, NDclose);
+    c->fd = -1;
+}
+
+/* Writes requests until "depth" of them are in flight. */
+static bool
+sendrequests(struct conn *c)
+{
+    while (c->inflight < depth) {
+        if (!c->woff)
+            c->sent[(c->head + c->inflight) % depth] = nowns();
+
+        const ssize_t w = send(c->fd, message + c->woff, msgsize - c->woff, MSG_NOSIGNAL);
+        if (w == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+        if ((c->woff += w) == msgsize) {
+            c->woff = 0;
+            c->inflight++;
+        }
+    }
+    return true;
+}
+
+static bool
+readresponses(struct conn *c)
+{
+    static _Thread_local uint8_t buf[64 * 1024];
+
+    for (;;) {
+        const ssize_t r = recv(c->fd, buf, sizeof(buf), 0);
+        if (r == 0)
+            return false;
+        if (r == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+        const uint64_t now = nowns();
+        c->roff += r;
+        while (c->roff >= msgsize && c->inflight) {
+            c->roff -= msgsize;
+            if (measuring()) {
+                hgrecord(&c->w->latency, now - c->sent[c->head]);
+                c->w->requests++;
+            }
+            c->head = (c->head + 1) % depth;
+            c->inflight--;
+        }
+    }
+}
+
+static void
+handle_echo(struct netloop *loop, int fd, int events, void *data)
+{
+    struct conn *c = data;
+
+    (void) loop;
+    (void) fd;
+
+    if ((events & NLerror) || ((events & NLread) && !readresponses(c)) || !sendrequests(c))
+        dropconn(c);
+}
+
+static void startdial(struct conn *c);
+
+/* Closing with a reset avoids piling up connections in TIME_WAIT. */
+static void
+resetclose(int fd)
+{
+    const struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    nethangup(fd, NDclose);
+}
+
+/*
+ * Dials which cannot be started (e.g. out of file descriptors) are retried
+ * after other dials complete, so the concurrency does not shrink over time.
+ */
+static void
+redial(struct conn *c)
+{
+    struct worker *w = c->w;
+
+    if (atomic_load(&phase) == Pdone)
+        return;
+
+    startdial(c);
+    for (unsigned i = 0; w->stalled && i < w->nconns; i++) {
+        if (w->conns[i].stalled)
+            startdial(&w->conns[i]);
+    }
+}
+
+static void
+handle_dial(struct netloop *loop, int fd, void *data)
+{
+    struct conn *c = data;
+    struct worker *w = c->w;
+    const uint64_t elapsed = nowns() - c->dialstart;
+
+    if (fd == -1) {
+        w->connerrors++;
+        if (mode == Mconnect)
+            redial(c);
+        return;
+    }
+
+    if (mode == Mconnect) {
+        if (measuring()) {
+            hgrecord(&w->connlat, elapsed);
+            w->connects++;
+        }
+        resetclose(fd);
+        redial(c);
+        return;
+    }
+
+    hgrecord(&w->connlat, elapsed);
+    c->fd = fd;
+    if (netloop_add(loop, fd, NLread | NLwrite, handle_echo, c) == -1) {
+        w->errors++;
+        nethangup(fd, NDclose);
+        c->fd = -1;
+        return;
+    }
+    if (!sendrequests(c))
+        dropconn(c);
+}
+
+static void
+startdial(struct conn *c)
+{
+    struct worker *w = c->w;
+
+    c->dialstart = nowns();
+    if (netloop_dial(w->loop, address, NDdefault, handle_dial, c) == -1) {
+        if (!c->stalled) {
+            w->connerrors++;
+            c->stalled = true;
+            w->stalled++;
+        }
+    } else if (c->stalled) {
+        c->stalled = false;
+        w->stalled--;
+    }
+}
+
+static void*
+run_worker(void *data)
+{
+    struct worker *w = data;
+
+    for (unsigned i = 0; i < w->nconns; i++)
+        startdial(&w->conns[i]);
+
+    if (netloop_run(w->loop) == -1)
+        fprintf(stderr, "Event loop failed: %s.\n", strerror(errno));
+
+    for (unsigned i = 0; i < w->nconns; i++) {
+        struct conn *c = &w->conns[i];
+        if (c->fd != -1) {
+            netloop_del(w->loop, c->fd);
+            nethangup(c->fd, NDclose);
+        }
+    }
+    return NULL;
+}
+
+static void
+sleepsecs(unsigned secs)
+{
+    struct timespec ts = { .tv_sec = secs };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+/* Thousands of connections easily go over the default soft limit. */
+static void
+raisefdlimit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+static const char *pctnames[] = { "p50", "p90", "p99", "p999" };
+
+/* Addresses may be paths of Unix sockets, with any characters. */
+static void
+printjsonstr(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        const unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void
+printlatency(const char *name, const struct histogram *h)
+{
+    if (json) {
+        printf("\"%s\": {\"count\": %" PRIu64 ", \"mean\": %.3f", name, h->count,
+               h->count ? h->sum / 1e3 / h->count : 0.0);
+        for (unsigned i = 0; i < nelem(percentiles); i++)
+            printf(", \"%s\": %.3f", pctnames[i], hgpercentile(h, percentiles[i]) / 1e3);
+        printf(", \"max\": %.3f}", h->max / 1e3);
+        return;
+    }
+
+    printf("%-10s mean %.1f", name, h->count ? h->sum / 1e3 / h->count : 0.0);
+    for (unsigned i = 0; i < nelem(percentiles); i++)
+        printf("  %s %.1f", pctnames[i], hgpercentile(h, percentiles[i]) / 1e3);
+    printf("  max %.1f (us)\n", h->max / 1e3);
+}
+
+static void
+report(struct worker *workers, double secs)
+{
+    /* The workers are done, fold their histograms into the first one's. */
+    struct histogram *connlat = &workers[0].connlat;
+    struct histogram *latency = &workers[0].latency;
+    uint64_t requests = 0, connects = 0, connerrors = 0, errors = 0;
+    unsigned stalled = 0;
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        if (i) {
+            hgmerge(connlat, &workers[i].connlat);
+            hgmerge(latency, &workers[i].latency);
+        }
+        requests += workers[i].requests;
+        connects += workers[i].connects;
+        connerrors += workers[i].connerrors;
+        errors += workers[i].errors;
+        stalled += workers[i].stalled;
+    }
+
+    const char *modename = (mode == Mecho) ? "echo" : "connect";
+
+    if (json) {
+        printf("{\"mode\": \"%s\", \"address\": ", modename);
+        printjsonstr(address);
+        printf(", \"connections\": %u, \"threads\": %u, \"duration\": %.3f, ",
+               nconns, nthreads, secs);
+        if (mode == Mecho) {
+            printf("\"size\": %zu, \"depth\": %u, \"requests\": %" PRIu64 ", "
+                   "\"rate\": %.1f, \"throughput\": %.1f, ",
+                   msgsize, depth, requests, requests / secs,
+                   2.0 * msgsize * requests / secs);
+        } else {
+            printf("\"connects\": %" PRIu64 ", \"rate\": %.1f, ",
+                   connects, connects / secs);
+        }
+        printf("\"connect_errors\": %" PRIu64 ", \"errors\": %" PRIu64 ", "
+               "\"stalled\": %u, ", connerrors, errors, stalled);
+        printlatency("connect_us", connlat);
+        if (mode == Mecho) {
+            printf(", ");
+            printlatency("latency_us", latency);
+        }
+        printf("}\n");
+    } else {
+        printf("%s %s, %u connections, %u threads, %.2f s\n",
+               modename, address, nconns, nthreads, secs);
+        if (mode == Mecho) {
+            printf("requests   %" PRIu64 " of %zu bytes, depth %u, %.1f/s, %.2f MiB/s\n",
+                   requests, msgsize, depth, requests / secs,
+                   2.0 * msgsize * requests / secs / (1024 * 1024));
+        } else {
+            printf("connects   %" PRIu64 ", %.1f/s\n", connects, connects / secs);
+        }
+        printf("errors     %" PRIu64 " connecting, %" PRIu64 " dropped, %u stalled\n",
+               connerrors, errors, stalled);
+        printlatency("connect", connlat);
+        if (mode == Mecho)
+            printlatency("latency", latency);
+    }
+
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options] <address>\n"
+            "Options:\n"
+            "  -m MODE   Mode, 'echo' (default) or 'connect'.\n"
+            "  -c N      Concurrent connections (default: %u).\n"
+            "  -t N      Threads (default: %u).\n"
+            "  -s BYTES  Echo request size (default: %zu).\n"
+            "  -p N      Echo requests in flight per connection (default: %u).\n"
+            "  -d SECS   Measurement duration (default: %u).\n"
+            "  -w SECS   Warmup duration (default: %u).\n"
+            "  -j        Print results as JSON.\n",
+            argv0, nconns, nthreads, msgsize, depth, duration, warmup);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "m:c:t:s:p:d:w:j")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "echo") == 0) {
+                    mode = Mecho;
+                } else if (strcmp(optarg, "connect") == 0) {
+                    mode = Mconnect;
+                } else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                nconns = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                nthreads = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                msgsize = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                duration = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                warmup = strtoul(optarg, NULL, 0);
+                break;
+            case 'j':
+                json = true;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    address = argv[optind];
+
+    if (!nconns || !nthreads || !msgsize || !depth || !duration) {
+        fprintf(stderr, "Invalid arguments.\n");
+        return EXIT_FAILURE;
+    }
+    if (nthreads > nconns)
+        nthreads = nconns;
+
+    raisefdlimit();
+
+    if (!(message = malloc(msgsize))) {
+        fprintf(stderr, "Cannot allocate memory.\n");
+        return EXIT_FAILURE;
+    }
+    memset(message, 'x', msgsize);
+
+    struct worker *workers = calloc(nthreads, sizeof(struct worker));
+    if (!workers) {
+        fprintf(stderr, "Cannot allocate memory.\n");
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        struct worker *w = &workers[i];
+        w->nconns = nconns / nthreads + (i < nconns % nthreads);
+
+        if (!(w->loop = netloop_new()) ||
+            !(w->conns = calloc(w->nconns, sizeof(struct conn)))) {
+            fprintf(stderr, "Cannot create worker: %s.\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        for (unsigned j = 0; j < w->nconns; j++) {
+            struct conn *c = &w->conns[j];
+            c->w = w;
+            c->fd = -1;
+            if (mode == Mecho && !(c->sent = calloc(depth, sizeof(uint64_t)))) {
+                fprintf(stderr, "Cannot allocate memory.\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    atomic_store(&phase, Pwarmup);
+    for (unsigned i = 0; i < nthreads; i++)
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+
+    sleepsecs(warmup);
+    const uint64_t start = nowns();
+    atomic_store(&phase, Pmeasure);
+    sleepsecs(duration);
+    atomic_store(&phase, Pdone);
+    const double secs = (nowns() - start) / 1e9;
+
+    for (unsigned i = 0; i < nthreads; i++)
+        netloop_stop(workers[i].loop);
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        netloop_free(workers[i].loop);
+    }
+
+    report(workers, secs);
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        for (unsigned j = 0; j < workers[i].nconns; j++)
+            free(workers[i].conns[j].sent);
+        free(workers[i].conns);
+    }
+    free(workers);
+    free(message);
+    return EXIT_SUCCESS;
+}
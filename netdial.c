@@ -17,6 +17,12 @@
 # define AUTODETECTED_ACCEPT4 1
 #endif /* __linux__ */
 
+#if defined(__linux__)
+# include <linux/filter.h>
+# include <linux/net_tstamp.h>
+# include <linux/sockios.h>
+#endif /* __linux__ */
+
 #if !defined(AUTODETECTED_ACCEPT4)
 # define AUTODETECTED_ACCEPT4 0
 #endif /* !AUTODETECTED_ACCEPT4 */
@@ -25,25 +31,50 @@
 # define HAVE_ACCEPT4 AUTODETECTED_ACCEPT4
 #endif /* !HAVE_ACCEPT4 */
 
-#include "dbuf/dbuf.h"
+#if !defined(HAVE_SYS_SDT_H)
+# define HAVE_SYS_SDT_H 0
+#endif /* !HAVE_SYS_SDT_H */
+
 #include "netdial.h"
+#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <net/if.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef nelem
 #define nelem(v) (sizeof(v) / sizeof(v[0]))
 #endif /* !nelem */
 
+#if HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define NDPROBE(name, t) \
+    DTRACE_PROBE6(netdial, name, (t)->fd, (t)->err, (t)->node, (t)->service, (t)->sa, (t)->salen)
+#else /* !HAVE_SYS_SDT_H */
+# define NDPROBE(name, t) ((void) 0)
+#endif /* HAVE_SYS_SDT_H */
+
 #if HAVE_ACCEPT4
 extern int accept4(int, struct sockaddr*, socklen_t*, int);
 #else /* !HAVE_ACCEPT4 */
@@ -54,7 +85,7 @@ accept4(int fd, struct sockaddr *sa, socklen_t *salen, int flags)
     if (nfd < 0)
         return nfd;
 
-    const int of = fcntl(nfd, F_GETFD);
+    const int of = fcntl(nfd, F_GETFL);
     if (of == -1)
         goto beach;
 
@@ -65,7 +96,11 @@ accept4(int fd, struct sockaddr *sa, socklen_t *salen, int flags)
         nf &= ~O_NONBLOCK;
 
     if (nf != of)
-        if (fcntl(nfd, F_SETFD, nf) == -1)
+        if (fcntl(nfd, F_SETFL, nf) == -1)
+            goto beach;
+
+    if (flags & SOCK_CLOEXEC)
+        if (fcntl(nfd, F_SETFD, FD_CLOEXEC) == -1)
             goto beach;
 
     return nfd;
@@ -84,17 +119,118 @@ beach:
 #define SO_PASSEC 0
 #endif /* !SO_PASSEC */
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 0
+#endif /* !SO_ZEROCOPY */
+
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif /* !SOL_UDP */
+
+#if defined(__linux__) && !defined(UDP_GRO)
+#define UDP_GRO 104
+#endif /* __linux__ && !UDP_GRO */
+
+#ifndef UDP_GRO
+#define UDP_GRO 0
+#endif /* !UDP_GRO */
+
 static const struct {
     int ndflag;
+    int level;
     int sockopt;
 } optflags[] = {
-    { NDpasscred,  SO_PASSCRED  },
-    { NDpassec,    SO_PASSEC    },
-    { NDbroadcast, SO_BROADCAST },
-    { NDdebug,     SO_DEBUG     },
-    { NDkeepalive, SO_KEEPALIVE },
-    { NDreuseaddr, SO_REUSEADDR },
-    { NDreuseport, SO_REUSEPORT },
+    { NDpasscred,  SOL_SOCKET, SO_PASSCRED  },
+    { NDpassec,    SOL_SOCKET, SO_PASSEC    },
+    { NDbroadcast, SOL_SOCKET, SO_BROADCAST },
+    { NDdebug,     SOL_SOCKET, SO_DEBUG     },
+    { NDkeepalive, SOL_SOCKET, SO_KEEPALIVE },
+    { NDreuseaddr, SOL_SOCKET, SO_REUSEADDR },
+    { NDreuseport, SOL_SOCKET, SO_REUSEPORT },
+    { NDzerocopy,  SOL_SOCKET, SO_ZEROCOPY  },
+    { NDudpgro,    SOL_UDP,    UDP_GRO      },
+};
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 0
+#endif /* !SO_BUSY_POLL */
+
+#ifndef TCP_QUICKACK
+#define TCP_QUICKACK 0
+#endif /* !TCP_QUICKACK */
+
+#ifndef TCP_DEFER_ACCEPT
+#define TCP_DEFER_ACCEPT 0
+#endif /* !TCP_DEFER_ACCEPT */
+
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 0
+#endif /* !TCP_FASTOPEN */
+
+#ifndef MSG_FASTOPEN
+#define MSG_FASTOPEN 0
+#endif /* !MSG_FASTOPEN */
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 0
+#endif /* !TCP_FASTOPEN_CONNECT */
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 0
+#endif /* !TCP_NOTSENT_LOWAT */
+
+#ifndef TCP_USER_TIMEOUT
+#define TCP_USER_TIMEOUT 0
+#endif /* !TCP_USER_TIMEOUT */
+
+#ifndef SIOCINQ
+#define SIOCINQ FIONREAD
+#endif /* !SIOCINQ */
+
+#ifndef SIOCOUTQ
+#define SIOCOUTQ 0
+#endif /* !SIOCOUTQ */
+
+enum optvalue {
+    OVbool,    /* 0 or 1. */
+    OVnumber,  /* Decimal number. */
+    OVsize,    /* Decimal number, optionally with a K, M, or G suffix. */
+};
+
+enum optphase {
+    OPbefore,  /* Before bind() or connect(). */
+    OPafter,   /* After listen() or connect(). */
+};
+
+/*
+ * Options which may be given in address strings, e.g. "tcp:host:80?nodelay".
+ * The socket option used may differ for dialing and listening sockets, zero
+ * when the option does not apply. A negative default means that a value
+ * needs to be given.
+ */
+static const struct {
+    const char *name;
+    enum optvalue value;
+    enum optphase phase;
+    bool tcponly;
+    int defvalue;
+    int level;
+    int dialopt, listenopt;
+} sockopts[] = {
+    { "nodelay",      OVbool,   OPbefore, true,   1, IPPROTO_TCP, TCP_NODELAY,          TCP_NODELAY       },
+    { "quickack",     OVbool,   OPafter,  true,   1, IPPROTO_TCP, TCP_QUICKACK,         0                 },
+    { "deferaccept",  OVnumber, OPbefore, true,  -1, IPPROTO_TCP, 0,                    TCP_DEFER_ACCEPT  },
+    { "fastopen",     OVnumber, OPbefore, true, 256, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, TCP_FASTOPEN      },
+    { "notsentlowat", OVsize,   OPbefore, true,  -1, IPPROTO_TCP, TCP_NOTSENT_LOWAT,    TCP_NOTSENT_LOWAT },
+    { "usertimeout",  OVnumber, OPbefore, true,  -1, IPPROTO_TCP, TCP_USER_TIMEOUT,     TCP_USER_TIMEOUT  },
+    { "rcvbuf",       OVsize,   OPbefore, false, -1, SOL_SOCKET,  SO_RCVBUF,            SO_RCVBUF         },
+    { "sndbuf",       OVsize,   OPbefore, false, -1, SOL_SOCKET,  SO_SNDBUF,            SO_SNDBUF         },
+    { "busypoll",     OVnumber, OPbefore, false, -1, SOL_SOCKET,  SO_BUSY_POLL,         SO_BUSY_POLL      },
+};
+
+struct netopts {
+    uint16_t mask;  /* Bit N set when sockopts[N] was given. */
+    int value[nelem(sockopts)];
 };
 
 enum {
@@ -127,8 +263,10 @@ getnettype(const char *name, unsigned namelen, int *family, int *socktype)
     if (!namelen)
         return false;
 
+    /* Names must match completely, "tc" is not a prefix match for "tcp". */
     for (unsigned i = 0; i < nelem(nettypes); i++) {
-        if (strncasecmp(name, nettypes[i].name, namelen) == 0) {
+        if (strlen(nettypes[i].name) == namelen &&
+            strncasecmp(name, nettypes[i].name, namelen) == 0) {
             *family = nettypes[i].family;
             *socktype = nettypes[i].socktype;
             return true;
@@ -153,8 +291,199 @@ struct netaddr {
     char service[NI_MAXSERV + 1];
     uint16_t addrlen;
     uint16_t servlen;
+
+    /* Numeric addresses are converted while parsing, see parsenumeric(). */
+    bool numeric;
+    struct sockaddr_storage sa;
+    struct addrinfo ai;
+
+    struct netopts opts;
 };
 
+static bool
+parseport(const char *s, unsigned len, uint16_t *port)
+{
+    if (len == 0 || len > 5)
+        return false;
+
+    unsigned value = 0;
+    for (unsigned i = 0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return false;
+        value = value * 10 + (s[i] - '0');
+    }
+    if (value > UINT16_MAX)
+        return false;
+
+    *port = value;
+    return true;
+}
+
+/*
+ * Fills the socket address for numeric hosts and ports, which then do not
+ * need to go through getaddrinfo(). IPv6 zones may be given by name or
+ * index, e.g. "[fe80::1%eth0]" or "[fe80::1%2]".
+ */
+static bool
+parsenumeric(struct netaddr *na)
+{
+    assert(na);
+
+    uint16_t port;
+    if (!na->addrlen || !parseport(na->service, na->servlen, &port))
+        return false;
+
+    memset(&na->sa, 0, sizeof(struct sockaddr_in6));
+
+    socklen_t salen;
+    if (na->family != AF_INET6 &&
+        inet_pton(AF_INET, na->address, &((struct sockaddr_in*) &na->sa)->sin_addr) == 1) {
+        struct sockaddr_in *sin = (struct sockaddr_in*) &na->sa;
+        sin->sin_family = na->family = AF_INET;
+        sin->sin_port = htons(port);
+        salen = sizeof(struct sockaddr_in);
+    } else if (na->family != AF_INET) {
+        char host[INET6_ADDRSTRLEN];
+        const char *zone = memchr(na->address, '%', na->addrlen);
+        const unsigned hostlen = zone ? (unsigned) (zone - na->address) : na->addrlen;
+        if (hostlen >= sizeof(host))
+            return false;
+        memcpy(host, na->address, hostlen);
+        host[hostlen] = '\0';
+
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &na->sa;
+        if (inet_pton(AF_INET6, host, &sin6->sin6_addr) != 1)
+            return false;
+
+        if (zone++) {
+            const unsigned zonelen = na->addrlen - hostlen - 1;
+            uint32_t scope = 0;
+            for (unsigned i = 0; i < zonelen; i++) {
+                if (zone[i] < '0' || zone[i] > '9') {
+                    scope = if_nametoindex(zone);
+                    break;
+                }
+                scope = scope * 10 + (zone[i] - '0');
+            }
+            if (!scope)
+                return false;
+            sin6->sin6_scope_id = scope;
+        }
+
+        sin6->sin6_family = na->family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        salen = sizeof(struct sockaddr_in6);
+    } else {
+        return false;
+    }
+
+    na->ai = (struct addrinfo) {
+        .ai_family = na->family,
+        .ai_socktype = na->socktype,
+        .ai_addrlen = salen,
+        .ai_addr = (struct sockaddr*) &na->sa,
+    };
+    return (na->numeric = true);
+}
+
+static bool
+parseoptvalue(const char *s, unsigned len, enum optvalue kind, int *value)
+{
+    unsigned shift = 0;
+    if (kind == OVsize && len > 1) {
+        switch (s[len - 1]) {
+            case 'k': case 'K': shift = 10; break;
+            case 'm': case 'M': shift = 20; break;
+            case 'g': case 'G': shift = 30; break;
+        }
+        if (shift)
+            len--;
+    }
+
+    if (len == 0 || len > 10)
+        return false;
+
+    uint64_t n = 0;
+    for (unsigned i = 0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return false;
+        n = n * 10 + (s[i] - '0');
+    }
+    n <<= shift;
+
+    if (n > INT_MAX || (kind == OVbool && n > 1))
+        return false;
+
+    *value = n;
+    return true;
+}
+
+/* Parses "name[=value]" options separated by ampersands. */
+static bool
+parseopts(const char *s, unsigned len, int socktype, struct netopts *opts)
+{
+    const char *end = s + len;
+    while (s < end) {
+        const char *amp = memchr(s, '&', end - s);
+        const unsigned optlen = (amp ? amp : end) - s;
+        const char *eq = memchr(s, '=', optlen);
+        const unsigned namelen = eq ? (unsigned) (eq - s) : optlen;
+
+        unsigned i = 0;
+        for (; i < nelem(sockopts); i++)
+            if (strlen(sockopts[i].name) == namelen &&
+                strncasecmp(s, sockopts[i].name, namelen) == 0)
+                break;
+        if (i == nelem(sockopts))
+            return false;
+
+        /* Unsupported by the protocol, or in this build. */
+        if ((sockopts[i].tcponly && socktype != SOCK_STREAM) ||
+            (!sockopts[i].dialopt && !sockopts[i].listenopt))
+            return false;
+
+        int value = sockopts[i].defvalue;
+        if (eq) {
+            if (!parseoptvalue(eq + 1, optlen - namelen - 1, sockopts[i].value, &value))
+                return false;
+        } else if (value < 0) {
+            return false;
+        }
+
+        opts->mask |= 1U << i;
+        opts->value[i] = value;
+
+        if (!amp)
+            break;
+        s = amp + 1;
+    }
+
+    return true;
+}
+
+static bool
+applyopts(int fd, const struct netopts *opts, bool listen, enum optphase phase)
+{
+    if (!opts->mask)
+        return true;
+
+    for (unsigned i = 0; i < nelem(sockopts); i++) {
+        if (!(opts->mask & (1U << i)) || sockopts[i].phase != phase)
+            continue;
+
+        const int optname = listen ? sockopts[i].listenopt : sockopts[i].dialopt;
+        if (!optname)
+            continue;
+
+        /* TCP_FASTOPEN takes the queue length, TCP_FASTOPEN_CONNECT a boolean. */
+        const int value = (optname == TCP_FASTOPEN_CONNECT) ? !!opts->value[i] : opts->value[i];
+        if (setsockopt(fd, sockopts[i].level, optname, &value, sizeof(value)))
+            return false;
+    }
+
+    return true;
+}
+
 static bool
 netaddrparse(const char *str, struct netaddr *na)
 {
@@ -163,7 +492,8 @@ netaddrparse(const char *str, struct netaddr *na)
     if (!str)
         return false;
 
-    *na = (struct netaddr) {};
+    na->numeric = false;
+    na->opts.mask = 0;
 
     const char *type = str;
     const char *colon = strchr(type, ':');
@@ -201,18 +531,29 @@ netaddrparse(const char *str, struct netaddr *na)
     na->addrlen = nodelen;
 
     /* Port is optional for Unix sockets. */
-    if (!colon)
+    if (!colon) {
+        na->service[0] = '\0';
+        na->servlen = 0;
         return na->family == AF_UNIX;
+    }
 
+    /* Socket options may follow the service, e.g. "tcp:host:80?nodelay". */
     const char *service = ++colon;
-    const unsigned servicelen = strlen(service);
+    const char *query = strchr(service, '?');
+    const unsigned servicelen = query ? (unsigned) (query - service) : strlen(service);
     if (servicelen > NI_MAXSERV)
         return false;
 
+    if (query && !parseopts(query + 1, strlen(query + 1), na->socktype, &na->opts))
+        return false;
+
     memcpy(na->service, service, servicelen);
     na->service[servicelen] = '\0';
     na->servlen = servicelen;
 
+    if (na->family != AF_UNIX)
+        parsenumeric(na);
+
     return true;
 }
 
@@ -227,14 +568,81 @@ applyflags(int fd, int flags)
 
         if (flags & optflags[i].ndflag) {
             static const int value = 1;
-            if (setsockopt(fd, SOL_SOCKET, optflags[i].sockopt, &value, sizeof(value)))
+            if (setsockopt(fd, optflags[i].level, optflags[i].sockopt, &value, sizeof(value)))
+                return false;
+        }
+    }
+
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+    if (flags & NDtimestamp) {
+        /* Takes a mask of the timestamps to generate and report. */
+        int value = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+                    SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE |
+                    SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_TX_ACK |
+                    SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                    SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &value, sizeof(value))) {
+            /* TCP sockets only take OPT_ID once connected, go without it. */
+            value &= ~SOF_TIMESTAMPING_OPT_ID;
+            if (errno != EINVAL ||
+                setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &value, sizeof(value)))
                 return false;
         }
     }
+#endif /* __linux__ && SO_TIMESTAMPING */
 
     return true;
 }
 
+/*
+ * Events go to USDT probes when built with HAVE_SYS_SDT_H, which are no-op
+ * instructions until a tracer attaches, and to the callback configured with
+ * nettraceconfig(), which costs one atomic load while unset. The event is
+ * built in place with designated initializers, and optimized away when no
+ * probe uses it.
+ */
+static struct {
+    _Atomic(nettracefn) fn;
+    void *_Atomic data;
+} tracer;
+
+#define TRACE(probe, ...)                                                   \
+    do {                                                                    \
+        const struct nettrace trace_ = { __VA_ARGS__ };                     \
+        NDPROBE(probe, &trace_);                                            \
+        const nettracefn tracefn_ =                                         \
+            atomic_load_explicit(&tracer.fn, memory_order_acquire);         \
+        if (tracefn_)                                                       \
+            tracecall(tracefn_, &trace_);                                   \
+    } while (0)
+
+static void
+tracecall(nettracefn fn, const struct nettrace *t)
+{
+    const int saved = errno;
+    (*fn)(t, atomic_load_explicit(&tracer.data, memory_order_relaxed));
+    errno = saved;
+}
+
+void
+nettraceconfig(nettracefn fn, void *data)
+{
+    atomic_store_explicit(&tracer.data, data, memory_order_relaxed);
+    atomic_store_explicit(&tracer.fn, fn, memory_order_release);
+}
+
+/* Reports the outcome of binding or connecting a socket. */
+static inline void
+tracesockop(bool passive, int fd, const struct sockaddr *sa, socklen_t salen, int err)
+{
+    if (passive) {
+        TRACE(bind, .event = NTbind, .fd = fd, .err = err, .sa = sa, .salen = salen);
+    } else {
+        TRACE(connect__done, .event = NTconnectdone, .fd = fd, .err = err,
+              .sa = sa, .salen = salen);
+    }
+}
+
 static int
 unixsocket(const struct netaddr *na, int flags,
            int (*op)(int, const struct sockaddr*, socklen_t))
@@ -259,180 +667,2085 @@ unixsocket(const struct netaddr *na, int flags,
     if (fd == -1)
         return -1;
 
-    if ((*op)(fd, (const struct sockaddr*) &name, sizeof(name)) == -1) {
+    const struct sockaddr *sa = (const struct sockaddr*) &name;
+    const bool passive = (op == bind);
+    if (!passive)
+        TRACE(connect__start, .event = NTconnectstart, .fd = fd, .sa = sa, .salen = sizeof(name));
+
+    if (!applyflags(fd, flags) || (*op)(fd, sa, sizeof(name)) == -1) {
+        tracesockop(passive, fd, sa, sizeof(name), errno);
         close(fd);
         return -1;
     }
 
+    tracesockop(passive, fd, sa, sizeof(name), 0);
     return fd;
 }
 
+/* Copies a list of resolved addresses into a single free()able block. */
 static struct addrinfo*
-netaddrinfo(const struct netaddr *na, int *errcode, bool listen)
+addrinfodup(const struct addrinfo *ra)
 {
-    assert(na);
-    assert(errcode);
-
-    const struct addrinfo hints = {
-        .ai_family = na->family,
-        .ai_socktype = na->socktype,
-        .ai_flags = (listen ? AI_PASSIVE : 0),
+    struct addrinfocopy {
+        struct addrinfo ai;
+        struct sockaddr_storage addr;
     };
 
-    struct addrinfo *result = NULL;
-    if ((*errcode = getaddrinfo(na->addrlen ? na->address : NULL,
-                                na->service, &hints, &result))) {
-        if (result)
-            freeaddrinfo(result);
+    unsigned n = 0;
+    for (const struct addrinfo *ai = ra; ai; ai = ai->ai_next)
+        n++;
+
+    struct addrinfocopy *copy = calloc(n, sizeof(struct addrinfocopy));
+    if (!copy)
         return NULL;
+
+    unsigned i = 0;
+    for (const struct addrinfo *ai = ra; ai; ai = ai->ai_next, i++) {
+        assert(ai->ai_addrlen <= sizeof(copy[i].addr));
+        memcpy(&copy[i].addr, ai->ai_addr, ai->ai_addrlen);
+        copy[i].ai = (struct addrinfo) {
+            .ai_flags = ai->ai_flags,
+            .ai_family = ai->ai_family,
+            .ai_socktype = ai->ai_socktype,
+            .ai_protocol = ai->ai_protocol,
+            .ai_addrlen = ai->ai_addrlen,
+            .ai_addr = (struct sockaddr*) &copy[i].addr,
+            .ai_next = (i + 1 < n) ? &copy[i + 1].ai : NULL,
+        };
     }
 
-    return result;
+    return &copy->ai;
 }
 
-static int
-inetsocket(const struct netaddr *na, int flags,
-           int (*op)(int, const struct sockaddr*, socklen_t))
-{
-    int sockflags = 0;
-    if (!(flags & NDexeckeep))
-        sockflags |= SOCK_CLOEXEC;
-    if (!(flags & NDblocking))
-        sockflags |= SOCK_NONBLOCK;
+enum {
+    NDcachemaxbuckets = 1U << 20,  /* 8 MiB of bucket pointers. */
+};
 
-    /* TODO: Use "errcode" for something. */
-    int errcode;
-    struct addrinfo *ra = netaddrinfo(na, &errcode, op == bind);
-    if (!ra)
-        return -1;
+struct cacheentry {
+    struct cacheentry *hnext;        /* Next in hash bucket. */
+    struct cacheentry *prev, *next;  /* LRU list, most recently used first. */
+    uint32_t hash;
+    int family, socktype;
+    bool passive;
+    int errcode;                     /* Non-zero for negative entries. */
+    int64_t expires;
+    struct addrinfo *ai;
+    uint16_t addrlen, servlen;
+    char key[];                      /* Node and service, NUL-separated. */
+};
 
-    int fd = -1;
-    for (struct addrinfo *ai = ra; ai; ai = ai->ai_next) {
-        const int socktype = ai->ai_socktype | sockflags;
-        if ((fd = socket(ai->ai_family, socktype, ai->ai_protocol)) == -1)
-            continue;
+static struct {
+    pthread_mutex_t lock;
+    atomic_uint maxsize;             /* Zero when disabled. */
+    unsigned size, nbuckets;
+    unsigned ttl, negttl;
+    struct cacheentry **buckets;
+    struct cacheentry *head, *tail;
+    unsigned long hits, misses, evictions;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-        if ((*op)(fd, ai->ai_addr, ai->ai_addrlen) != -1)
-            break;
+static int64_t
+nowms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        close(fd);
-        fd = -1;
-    }
+static uint32_t
+cachehash(const struct netaddr *na, bool passive)
+{
+    /* FNV-1a. */
+    uint32_t h = 2166136261U;
+    const int k[] = { na->family, na->socktype, passive };
+    for (unsigned i = 0; i < sizeof(k); i++)
+        h = (h ^ ((const uint8_t*) k)[i]) * 16777619U;
+    for (unsigned i = 0; i < na->addrlen; i++)
+        h = (h ^ (uint8_t) na->address[i]) * 16777619U;
+    h = (h ^ ':') * 16777619U;
+    for (unsigned i = 0; i < na->servlen; i++)
+        h = (h ^ (uint8_t) na->service[i]) * 16777619U;
+    return h;
+}
 
-    freeaddrinfo(ra);
-    return fd;
+static bool
+cachematch(const struct cacheentry *e, uint32_t hash,
+           const struct netaddr *na, bool passive)
+{
+    return e->hash == hash
+        && e->family == na->family
+        && e->socktype == na->socktype
+        && e->passive == passive
+        && e->addrlen == na->addrlen
+        && e->servlen == na->servlen
+        && memcmp(e->key, na->address, na->addrlen) == 0
+        && memcmp(e->key + na->addrlen + 1, na->service, na->servlen) == 0;
 }
 
-int
-netdial(const char *address, int flags)
+static void
+cacheunlink(struct cacheentry *e)
 {
-    struct netaddr na;
-    if (!netaddrparse(address, &na)) {
-        errno = EINVAL;
-        return -1;
-    }
+    struct cacheentry **p = &cache.buckets[e->hash & (cache.nbuckets - 1)];
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
 
-    int fd;
-    if (na.family == AF_UNIX) {
-        fd = unixsocket(&na, flags, connect);
-    } else {
-        flags &= ~NDunixoptmask;
-        fd = inetsocket(&na, flags, connect);
-    }
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache.tail = e->prev;
 
-    if (fd == -1)
-        return -1;
+    cache.size--;
+    free(e->ai);
+    free(e);
+}
 
-    if (!applyflags(fd, flags)) {
-        close(fd);
-        return -1;
-    }
+static void
+cachepushfront(struct cacheentry *e)
+{
+    e->prev = NULL;
+    if ((e->next = cache.head))
+        cache.head->prev = e;
+    else
+        cache.tail = e;
+    cache.head = e;
+}
 
-    return fd;
+static struct cacheentry*
+cachelookup(uint32_t hash, const struct netaddr *na, bool passive)
+{
+    struct cacheentry *e = cache.buckets[hash & (cache.nbuckets - 1)];
+    while (e && !cachematch(e, hash, na, passive))
+        e = e->hnext;
+    return e;
 }
 
-int
-netannounce(const char *address, int flags, int backlog)
+/* Only cache definitive failures, like RFC 2308 does for DNS. */
+static bool
+cachenegative(int errcode)
 {
-    struct netaddr na;
-    if (!netaddrparse(address, &na)) {
-        errno = EINVAL;
-        return -1;
+    switch (errcode) {
+        case EAI_NONAME:
+        case EAI_SERVICE:
+#ifdef EAI_NODATA
+        case EAI_NODATA:
+#endif /* EAI_NODATA */
+#ifdef EAI_ADDRFAMILY
+        case EAI_ADDRFAMILY:
+#endif /* EAI_ADDRFAMILY */
+            return true;
+        default:
+            return false;
     }
+}
 
-    int fd;
-    if (na.family == AF_UNIX) {
-        fd = unixsocket(&na, flags, bind);
-    } else {
-        flags &= ~NDunixoptmask;
-        fd = inetsocket(&na, flags, bind);
+static void
+cacheinsert(uint32_t hash, const struct netaddr *na, bool passive,
+            const struct addrinfo *ai, int errcode)
+{
+    const unsigned ttl = errcode ? cache.negttl : cache.ttl;
+    if (ttl == 0 || (errcode && !cachenegative(errcode)))
+        return;
+
+    struct addrinfo *copy = NULL;
+    if (ai && !(copy = addrinfodup(ai)))
+        return;
+
+    struct cacheentry *e = malloc(sizeof(struct cacheentry) +
+                                  na->addrlen + na->servlen + 2);
+    if (!e) {
+        free(copy);
+        return;
     }
 
-    if (fd == -1)
-        return -1;
+    *e = (struct cacheentry) {
+        .hash = hash,
+        .family = na->family,
+        .socktype = na->socktype,
+        .passive = passive,
+        .errcode = errcode,
+        .expires = nowms() + ttl,
+        .ai = copy,
+        .addrlen = na->addrlen,
+        .servlen = na->servlen,
+    };
+    memcpy(e->key, na->address, na->addrlen);
+    e->key[na->addrlen] = '\0';
+    memcpy(e->key + na->addrlen + 1, na->service, na->servlen);
+    e->key[na->addrlen + na->servlen + 1] = '\0';
+
+    pthread_mutex_lock(&cache.lock);
+    if (cache.buckets) {
+        /* Another thread may have resolved the same address meanwhile. */
+        struct cacheentry *old = cachelookup(hash, na, passive);
+        if (old)
+            cacheunlink(old);
+
+        while (cache.size >= atomic_load_explicit(&cache.maxsize, memory_order_relaxed)) {
+            cacheunlink(cache.tail);
+            cache.evictions++;
+        }
 
-    if (!applyflags(fd, flags) || listen(fd, (backlog > 0) ? backlog : 5) < 0) {
-        close(fd);
-        return -1;
+        struct cacheentry **bucket = &cache.buckets[hash & (cache.nbuckets - 1)];
+        e->hnext = *bucket;
+        *bucket = e;
+        cachepushfront(e);
+        cache.size++;
+        e = NULL;
     }
+    pthread_mutex_unlock(&cache.lock);
 
-    return fd;
+    if (e) {
+        /* Cache got disabled while resolving. */
+        free(e->ai);
+        free(e);
+    }
 }
 
-static char*
-mknetaddr(int fd, const struct sockaddr_storage *sa, socklen_t salen)
+/*
+ * Looks up an address in the cache. Returns true on a hit, in which case
+ * *result is a copy of the cached addresses, or NULL for negative entries.
+ */
+static bool
+cacheget(uint32_t hash, const struct netaddr *na, bool passive,
+         struct addrinfo **result, int *errcode)
 {
-    assert(sa);
-
-    int socktype;
-    socklen_t socktypelen = sizeof(socktype);
-    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &socktype, &socktypelen))
-        socktype = SOCK_STREAM;
-
-    const char *netname = getnetname(sa->ss_family, socktype);
-    if (!netname)
-        return NULL;
+    bool hit = false;
 
-    struct dbuf b = DBUF_INIT;
-    dbuf_addstr(&b, netname);
-    dbuf_addch(&b, ':');
+    pthread_mutex_lock(&cache.lock);
+    struct cacheentry *e = cache.buckets ? cachelookup(hash, na, passive) : NULL;
+    if (e && e->expires <= nowms()) {
+        cacheunlink(e);
+        e = NULL;
+    }
 
-    switch (sa->ss_family) {
-        case AF_UNIX:
-            dbuf_addmem(&b, ((const struct sockaddr_un*) sa)->sun_path, salen);
-            break;
-        case AF_INET:
-        case AF_INET6: {
-            char host[NI_MAXHOST + 1];
-            char serv[NI_MAXSERV + 1];
-            if (getnameinfo((const struct sockaddr*) sa, salen,
-                            host, sizeof(host),
-                            serv, sizeof(serv),
-                            socktype == SOCK_DGRAM ? NI_DGRAM : 0 |
-                            NI_NUMERICHOST |
-                            NI_NUMERICSERV)) {
-                dbuf_clear(&b);
-                return NULL;
+    if (e) {
+        *errcode = e->errcode;
+        if ((*result = e->ai ? addrinfodup(e->ai) : NULL) || e->errcode) {
+            hit = true;
+            cache.hits++;
+
+            /* Move to the front of the LRU list. */
+            if (e != cache.head) {
+                e->prev->next = e->next;
+                if (e->next)
+                    e->next->prev = e->prev;
+                else
+                    cache.tail = e->prev;
+                cachepushfront(e);
             }
-
-            dbuf_addstr(&b, host);
-            dbuf_addch(&b, ':');
-            dbuf_addstr(&b, serv);
-            break;
         }
     }
+    if (!hit)
+        cache.misses++;
+    pthread_mutex_unlock(&cache.lock);
 
-    return dbuf_str(&b);
+    return hit;
 }
 
-int
-netaccept(int fd, int flags, char **remoteaddr)
+static void
+cacheclear(void)
 {
-    struct sockaddr_storage sa = {};
-    socklen_t salen = sizeof(sa);
-    int nfd = accept4(fd, (struct sockaddr*) &sa, &salen,
-                      (flags & NDblocking) ? 0 : SOCK_NONBLOCK |
-                      (flags & NDexeckeep) ? 0 : SOCK_CLOEXEC);
+    while (cache.head)
+        cacheunlink(cache.head);
+}
+
+void
+netcacheconfig(unsigned size, unsigned ttl, unsigned negttl)
+{
+    /* Larger caches get longer chains instead of more buckets. */
+    unsigned nbuckets = 1;
+    while (nbuckets < size && nbuckets < NDcachemaxbuckets)
+        nbuckets <<= 1;
+
+    struct cacheentry **buckets = size ? calloc(nbuckets, sizeof(struct cacheentry*)) : NULL;
+    if (size && !buckets)
+        size = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    cacheclear();
+    free(cache.buckets);
+    cache.buckets = buckets;
+    cache.nbuckets = nbuckets;
+    cache.ttl = ttl;
+    cache.negttl = negttl;
+    atomic_store_explicit(&cache.maxsize, size, memory_order_relaxed);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void
+netcacheflush(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    if (cache.buckets)
+        cacheclear();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void
+netcachestats(struct netcachestats *stats)
+{
+    assert(stats);
+
+    pthread_mutex_lock(&cache.lock);
+    *stats = (struct netcachestats) {
+        .hits = cache.hits,
+        .misses = cache.misses,
+        .evictions = cache.evictions,
+        .entries = cache.size,
+    };
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/*
+ * Statistics are kept per thread, so recording them needs neither locks nor
+ * atomic read-modify-write operations: each thread is the only writer of its
+ * counters, and snapshots read them with relaxed atomic loads. The lock only
+ * protects the list of threads, and is taken when a thread records its first
+ * value, when it exits, and for snapshots.
+ *
+ * Resetting bumps the epoch instead of writing into the counters of other
+ * threads, which would race with their updates: each thread clears its own
+ * counters when it sees a new epoch, and until then snapshots skip them.
+ */
+/*
+ * Histograms have eight buckets per power of two, coarser than the ones in
+ * netbench.c: there is one per operation in each thread, snapshots copy them
+ * all, and finer buckets would make them several times as large.
+ */
+enum {
+    NShistsubbits = 4,  /* 1 << (NShistsubbits - 1) buckets per power of two. */
+    NSerrnone     = NSerrmax,
+};
+
+typedef _Atomic unsigned long long statcount;
+
+struct threadstats {
+    struct threadstats *prev, *next;
+    atomic_uint epoch;
+    struct {
+        statcount calls, errors;
+        statcount sum, max;
+        statcount buckets[NShistbuckets];
+    } op[NSopmax];
+    statcount errors[NSerrmax];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    atomic_bool enabled;
+    atomic_uint epoch;
+    struct threadstats *threads;
+    struct netstats retired;  /* Totals from threads which exited. */
+} stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static _Thread_local struct threadstats *tstats;
+
+static inline void
+statadd(statcount *c, unsigned long long n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline unsigned long long
+statget(const statcount *c)
+{
+    return atomic_load_explicit((statcount*) c, memory_order_relaxed);
+}
+
+static inline unsigned
+histindex(uint64_t v)
+{
+    const unsigned sub = 1U << NShistsubbits;
+    if (v < sub)
+        return (unsigned) v;
+
+    const unsigned shift = (63 - __builtin_clzll(v)) - (NShistsubbits - 1);
+    const uint64_t i = (uint64_t) shift * (sub / 2) + (v >> shift);
+    return (i < NShistbuckets) ? (unsigned) i : NShistbuckets - 1;
+}
+
+static void
+statsmerge(struct netstats *s, const struct threadstats *t)
+{
+    for (unsigned i = 0; i < NSopmax; i++) {
+        s->op[i].calls += statget(&t->op[i].calls);
+        s->op[i].errors += statget(&t->op[i].errors);
+
+        struct nethistogram *h = &s->op[i].latency;
+        for (unsigned j = 0; j < NShistbuckets; j++) {
+            const unsigned long long n = statget(&t->op[i].buckets[j]);
+            h->buckets[j] += n;
+            h->count += n;
+        }
+        h->sum += statget(&t->op[i].sum);
+        const unsigned long long max = statget(&t->op[i].max);
+        if (max > h->max)
+            h->max = max;
+    }
+    for (unsigned i = 0; i < NSerrmax; i++)
+        s->errors[i] += statget(&t->errors[i]);
+}
+
+/* Whether the counters of a thread were cleared since the last reset. */
+static inline bool
+statscurrent(const struct threadstats *t)
+{
+    return atomic_load_explicit((atomic_uint*) &t->epoch, memory_order_acquire) ==
+           atomic_load_explicit(&stats.epoch, memory_order_relaxed);
+}
+
+/* Called by the thread which owns the counters. */
+static void
+statsclear(struct threadstats *t, unsigned epoch)
+{
+    for (unsigned i = 0; i < NSopmax; i++) {
+        atomic_store_explicit(&t->op[i].calls, 0, memory_order_relaxed);
+        atomic_store_explicit(&t->op[i].errors, 0, memory_order_relaxed);
+        atomic_store_explicit(&t->op[i].sum, 0, memory_order_relaxed);
+        atomic_store_explicit(&t->op[i].max, 0, memory_order_relaxed);
+        for (unsigned j = 0; j < NShistbuckets; j++)
+            atomic_store_explicit(&t->op[i].buckets[j], 0, memory_order_relaxed);
+    }
+    for (unsigned i = 0; i < NSerrmax; i++)
+        atomic_store_explicit(&t->errors[i], 0, memory_order_relaxed);
+
+    atomic_store_explicit(&t->epoch, epoch, memory_order_release);
+}
+
+/* Folds the statistics of an exiting thread into the totals. */
+static void
+statsretire(void *data)
+{
+    struct threadstats *t = data;
+
+    pthread_mutex_lock(&stats.lock);
+    if (statscurrent(t))
+        statsmerge(&stats.retired, t);
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        stats.threads = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    pthread_mutex_unlock(&stats.lock);
+
+    free(t);
+    tstats = NULL;
+}
+
+static void
+statsinit(void)
+{
+    pthread_key_create(&stats.key, statsretire);
+}
+
+static struct threadstats*
+getthreadstats(void)
+{
+    if (tstats)
+        return tstats;
+
+    struct threadstats *t = calloc(1, sizeof(struct threadstats));
+    if (!t)
+        return NULL;
+
+    pthread_once(&stats.once, statsinit);
+    if (pthread_setspecific(stats.key, t)) {
+        free(t);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stats.lock);
+    atomic_store_explicit(&t->epoch, atomic_load_explicit(&stats.epoch, memory_order_relaxed),
+                          memory_order_relaxed);
+    if ((t->next = stats.threads))
+        t->next->prev = t;
+    stats.threads = t;
+    pthread_mutex_unlock(&stats.lock);
+
+    return (tstats = t);
+}
+
+static inline uint64_t
+nowns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the start time of an operation, or zero if disabled. */
+static inline uint64_t
+statsstart(void)
+{
+    return atomic_load_explicit(&stats.enabled, memory_order_relaxed) ? nowns() : 0;
+}
+
+static unsigned
+errclass(int err)
+{
+    switch (err) {
+        case 0:
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif /* EWOULDBLOCK != EAGAIN */
+        case EINPROGRESS:
+        case EINTR:
+            return NSerrnone;
+        case ETIMEDOUT:
+            return NSerrtimeout;
+        case ECONNREFUSED:
+            return NSerrrefused;
+        case ENETUNREACH:
+        case EHOSTUNREACH:
+        case EADDRNOTAVAIL:
+            return NSerrunreach;
+        case ECONNRESET:
+        case ECONNABORTED:
+        case EPIPE:
+            return NSerrreset;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            return NSerrlimit;
+        default:
+            return NSerrother;
+    }
+}
+
+static void
+statsrecord(unsigned op, uint64_t start, unsigned errcls)
+{
+    const int saved = errno;
+
+    struct threadstats *t = getthreadstats();
+    if (t) {
+        const unsigned epoch = atomic_load_explicit(&stats.epoch, memory_order_acquire);
+        if (atomic_load_explicit(&t->epoch, memory_order_relaxed) != epoch)
+            statsclear(t, epoch);
+
+        const uint64_t elapsed = nowns() - start;
+        statadd(&t->op[op].calls, 1);
+        statadd(&t->op[op].buckets[histindex(elapsed)], 1);
+        statadd(&t->op[op].sum, elapsed);
+        if (elapsed > statget(&t->op[op].max))
+            atomic_store_explicit(&t->op[op].max, elapsed, memory_order_relaxed);
+        if (errcls != NSerrnone) {
+            statadd(&t->op[op].errors, 1);
+            /* Failed dials are classified by their attempts already. */
+            if (op != NSdial)
+                statadd(&t->errors[errcls], 1);
+        }
+    }
+
+    errno = saved;
+}
+
+/* Records an operation which failed with "err" (if non-zero). */
+static inline void
+statsend(unsigned op, uint64_t start, int err)
+{
+    if (start)
+        statsrecord(op, start, errclass(err));
+}
+
+void
+netstatsconfig(bool enable)
+{
+    atomic_store_explicit(&stats.enabled, enable, memory_order_relaxed);
+}
+
+void
+netstats_snapshot(struct netstats *s)
+{
+    assert(s);
+
+    pthread_mutex_lock(&stats.lock);
+    *s = stats.retired;
+    for (const struct threadstats *t = stats.threads; t; t = t->next)
+        if (statscurrent(t))
+            statsmerge(s, t);
+    pthread_mutex_unlock(&stats.lock);
+}
+
+void
+netstats_reset(void)
+{
+    pthread_mutex_lock(&stats.lock);
+    memset(&stats.retired, 0, sizeof(stats.retired));
+    atomic_fetch_add_explicit(&stats.epoch, 1, memory_order_release);
+    pthread_mutex_unlock(&stats.lock);
+}
+
+unsigned long long
+netstats_percentile(const struct nethistogram *h, double p)
+{
+    assert(h);
+
+    if (!h->count)
+        return 0;
+
+    unsigned long rank = (unsigned long) (p / 100.0 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    const unsigned sub = 1U << NShistsubbits;
+    unsigned long seen = 0;
+    for (unsigned i = 0; i < NShistbuckets; i++) {
+        if ((seen += h->buckets[i]) < rank)
+            continue;
+        if (i < sub)
+            return i;
+
+        /* Middle of the range of values in the bucket. */
+        const unsigned shift = i / (sub / 2) - 1;
+        const unsigned long long low = (unsigned long long) (i - shift * (sub / 2)) << shift;
+        const unsigned long long value = low + ((1ULL << shift) >> 1);
+        return (value < h->max) ? value : h->max;
+    }
+    return h->max;
+}
+
+/*
+ * Resolves an address. The result must be released with netfreeaddrinfo(),
+ * numeric addresses are returned directly from the parsed address.
+ */
+static struct addrinfo*
+netaddrinfo(const struct netaddr *na, int *errcode, bool listen)
+{
+    assert(na);
+    assert(errcode);
+
+    if (na->numeric) {
+        *errcode = 0;
+        return (struct addrinfo*) &na->ai;
+    }
+
+    const bool cached = atomic_load_explicit(&cache.maxsize, memory_order_relaxed) > 0;
+    const uint32_t hash = cached ? cachehash(na, listen) : 0;
+
+    struct addrinfo *copy = NULL;
+    if (cached && cacheget(hash, na, listen, &copy, errcode))
+        return copy;
+
+    uint16_t port;
+    const struct addrinfo hints = {
+        .ai_family = na->family,
+        .ai_socktype = na->socktype,
+        .ai_flags = (listen ? AI_PASSIVE : 0) |
+                    (parseport(na->service, na->servlen, &port) ? AI_NUMERICSERV : 0),
+    };
+
+    const char *node = na->addrlen ? na->address : NULL;
+    TRACE(resolve__start, .event = NTresolvestart, .fd = -1,
+          .node = node, .service = na->service);
+
+    const uint64_t start = statsstart();
+    struct addrinfo *result = NULL;
+    *errcode = getaddrinfo(node, na->service, &hints, &result);
+    if (start)
+        statsrecord(NSresolve, start, *errcode ? NSerrresolve : NSerrnone);
+
+    TRACE(resolve__done, .event = NTresolvedone, .fd = -1, .err = *errcode,
+          .node = node, .service = na->service);
+
+    if (*errcode) {
+        if (result)
+            freeaddrinfo(result);
+        if (cached)
+            cacheinsert(hash, na, listen, NULL, *errcode);
+        return NULL;
+    }
+
+    if (cached)
+        cacheinsert(hash, na, listen, result, 0);
+
+    copy = addrinfodup(result);
+    freeaddrinfo(result);
+    return copy;
+}
+
+static inline void
+netfreeaddrinfo(const struct netaddr *na, struct addrinfo *ai)
+{
+    if (ai != &na->ai)
+        free(ai);
+}
+
+/*
+ * Reorders a list of resolved addresses so address families alternate,
+ * keeping the relative order within each family and starting with the
+ * family of the first (preferred) address, as per RFC 8305, section 4.
+ */
+static struct addrinfo*
+interleaveaddrinfo(struct addrinfo *ra)
+{
+    if (!ra)
+        return NULL;
+
+    struct addrinfo *same = ra, **samenext = &same->ai_next;
+    struct addrinfo *other = NULL, **othernext = &other;
+    for (struct addrinfo *ai = ra->ai_next; ai; ai = ai->ai_next) {
+        if (ai->ai_family == ra->ai_family) {
+            *samenext = ai;
+            samenext = &ai->ai_next;
+        } else {
+            *othernext = ai;
+            othernext = &ai->ai_next;
+        }
+    }
+    *samenext = *othernext = NULL;
+
+    struct addrinfo *result = NULL, **next = &result;
+    while (same || other) {
+        if (same) {
+            *next = same;
+            next = &same->ai_next;
+            same = same->ai_next;
+        }
+        if (other) {
+            *next = other;
+            next = &other->ai_next;
+            other = other->ai_next;
+        }
+    }
+    *next = NULL;
+
+    return result;
+}
+
+/*
+ * Creates a socket for the first usable address. The "ra" list is used if
+ * given, otherwise the address gets resolved.
+ */
+static int
+inetsocket(const struct netaddr *na, const struct addrinfo *ra, int flags,
+           int (*op)(int, const struct sockaddr*, socklen_t))
+{
+    int sockflags = 0;
+    if (!(flags & NDexeckeep))
+        sockflags |= SOCK_CLOEXEC;
+    if (!(flags & NDblocking))
+        sockflags |= SOCK_NONBLOCK;
+
+    struct addrinfo *resolved = NULL;
+    if (!ra) {
+        /* TODO: Use "errcode" for something. */
+        int errcode;
+        if (!(ra = resolved = netaddrinfo(na, &errcode, op == bind)))
+            return -1;
+    }
+
+    const bool passive = (op == bind);
+    int fd = -1;
+    for (const struct addrinfo *ai = ra; ai; ai = ai->ai_next) {
+        const int socktype = ai->ai_socktype | sockflags;
+        const uint64_t start = passive ? 0 : statsstart();
+        if ((fd = socket(ai->ai_family, socktype, ai->ai_protocol)) == -1) {
+            statsend(NSconnect, start, errno);
+            continue;
+        }
+
+        if (!passive) {
+            TRACE(connect__start, .event = NTconnectstart, .fd = fd,
+                  .sa = ai->ai_addr, .salen = ai->ai_addrlen);
+        }
+
+        if (applyflags(fd, flags) && applyopts(fd, &na->opts, passive, OPbefore) &&
+            (*op)(fd, ai->ai_addr, ai->ai_addrlen) != -1) {
+            statsend(NSconnect, start, 0);
+            tracesockop(passive, fd, ai->ai_addr, ai->ai_addrlen, 0);
+            break;
+        }
+
+        /* Non-blocking connect: hand back the fd while in progress. */
+        statsend(NSconnect, start, errno);
+        tracesockop(passive, fd, ai->ai_addr, ai->ai_addrlen, errno);
+        if (op == connect && errno == EINPROGRESS)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    /* Listening sockets get the rest of options after listen(). */
+    if (fd != -1 && !passive && !applyopts(fd, &na->opts, false, OPafter)) {
+        const int err = errno;
+        close(fd);
+        fd = -1;
+        errno = err;
+    }
+
+    if (resolved)
+        netfreeaddrinfo(na, resolved);
+    return fd;
+}
+
+static int
+dialaddr(const struct netaddr *na, const struct addrinfo *ra, int flags)
+{
+    int fd;
+    if (na->family == AF_UNIX) {
+        const uint64_t start = statsstart();
+        fd = unixsocket(na, flags, connect);
+        statsend(NSconnect, start, (fd == -1) ? errno : 0);
+    } else {
+        flags &= ~NDunixoptmask;
+        fd = inetsocket(na, ra, flags, connect);
+    }
+
+    return fd;
+}
+
+int
+netdial(const char *address, int flags)
+{
+    const uint64_t start = statsstart();
+
+    struct netaddr na;
+    if (!netaddrparse(address, &na)) {
+        errno = EINVAL;
+        statsend(NSdial, start, errno);
+        return -1;
+    }
+
+    const int fd = dialaddr(&na, NULL, flags);
+    statsend(NSdial, start, (fd == -1) ? errno : 0);
+    return fd;
+}
+
+/* Sends data over a socket which may still be connecting. */
+static int
+dialsendafter(int fd, const void *buf, size_t *len)
+{
+    if (fd == -1)
+        return -1;
+
+    ssize_t r = send(fd, buf, *len, MSG_NOSIGNAL);
+    if (r == -1) {
+        /* Not connected yet, or no buffer space: nothing was sent. */
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTCONN) {
+            const int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        r = 0;
+    }
+
+    *len = r;
+    return fd;
+}
+
+static int
+dialsend(const char *address, int flags, const void *buf, size_t *len)
+{
+    struct netaddr na;
+    if (!netaddrparse(address, &na)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Only TCP can carry data along with the connection request. */
+    if (!MSG_FASTOPEN || na.family == AF_UNIX || na.socktype != SOCK_STREAM)
+        return dialsendafter(dialaddr(&na, NULL, flags), buf, len);
+
+    flags &= ~NDunixoptmask;
+
+    int sockflags = 0;
+    if (!(flags & NDexeckeep))
+        sockflags |= SOCK_CLOEXEC;
+    if (!(flags & NDblocking))
+        sockflags |= SOCK_NONBLOCK;
+
+    int errcode;
+    struct addrinfo *ra = netaddrinfo(&na, &errcode, false);
+    if (!ra)
+        return -1;
+
+    int fd = -1;
+    ssize_t sent = -1;
+    for (const struct addrinfo *ai = ra; ai; ai = ai->ai_next) {
+        const int socktype = ai->ai_socktype | sockflags;
+        const uint64_t start = statsstart();
+        if ((fd = socket(ai->ai_family, socktype, ai->ai_protocol)) == -1) {
+            statsend(NSconnect, start, errno);
+            continue;
+        }
+
+        TRACE(connect__start, .event = NTconnectstart, .fd = fd,
+              .sa = ai->ai_addr, .salen = ai->ai_addrlen);
+
+        if (applyflags(fd, flags) && applyopts(fd, &na.opts, false, OPbefore)) {
+            /*
+             * Without a cookie for the server the connection request goes
+             * out without data, non-blocking sockets fail with EINPROGRESS,
+             * and blocking ones send after the handshake is done.
+             */
+            sent = sendto(fd, buf, *len, MSG_FASTOPEN | MSG_NOSIGNAL,
+                          ai->ai_addr, ai->ai_addrlen);
+            const int err = (sent == -1) ? errno : 0;
+            if (sent == -1 && errno == EINPROGRESS)
+                sent = 0;
+            if (sent != -1 && applyopts(fd, &na.opts, false, OPafter)) {
+                statsend(NSconnect, start, 0);
+                tracesockop(false, fd, ai->ai_addr, ai->ai_addrlen, err);
+                break;
+            }
+
+            /* Fast Open disabled in the system, connect normally. */
+            if (errno == EOPNOTSUPP) {
+                tracesockop(false, fd, ai->ai_addr, ai->ai_addrlen, EOPNOTSUPP);
+                close(fd);
+                netfreeaddrinfo(&na, ra);
+                return dialsendafter(dialaddr(&na, NULL, flags), buf, len);
+            }
+        }
+
+        const int err = errno;
+        statsend(NSconnect, start, err);
+        tracesockop(false, fd, ai->ai_addr, ai->ai_addrlen, err);
+        close(fd);
+        fd = -1;
+        errno = err;
+    }
+
+    netfreeaddrinfo(&na, ra);
+    if (fd != -1)
+        *len = sent;
+    return fd;
+}
+
+int
+netdialsend(const char *address, int flags, const void *buf, size_t *len)
+{
+    assert(len);
+    assert(buf || !*len);
+
+    const uint64_t start = statsstart();
+    const int fd = dialsend(address, flags, buf, len);
+    statsend(NSdial, start, (fd == -1) ? errno : 0);
+    return fd;
+}
+
+struct netdialer {
+    struct addrinfo *ra;   /* Resolved addresses, NULL for Unix sockets. */
+    struct addrinfo *ai;   /* Next candidate to try. */
+    const struct addrinfo *cur;  /* Candidate being connected. */
+    int fd;
+    int flags;
+    bool connected;
+    struct netopts opts;
+    uint64_t start;         /* For statistics, zero if disabled. */
+    uint64_t attemptstart;
+};
+
+static void
+freedialer(struct netdialer *d)
+{
+    assert(d);
+
+    if (d->ra)
+        free(d->ra);
+    free(d);
+}
+
+/*
+ * Starts a non-blocking connection to the next usable candidate address.
+ * On failure errno is left with the error from the last attempted one.
+ */
+static bool
+dialnext(struct netdialer *d)
+{
+    assert(d);
+
+    int sockflags = SOCK_NONBLOCK;
+    if (!(d->flags & NDexeckeep))
+        sockflags |= SOCK_CLOEXEC;
+
+    while (d->ai) {
+        const struct addrinfo *ai = d->ai;
+        d->ai = ai->ai_next;
+
+        d->attemptstart = d->start ? statsstart() : 0;
+        int fd = socket(ai->ai_family, ai->ai_socktype | sockflags, ai->ai_protocol);
+        if (fd == -1) {
+            statsend(NSconnect, d->attemptstart, errno);
+            continue;
+        }
+
+        TRACE(connect__start, .event = NTconnectstart, .fd = fd,
+              .sa = ai->ai_addr, .salen = ai->ai_addrlen);
+
+        if (!applyflags(fd, d->flags) || !applyopts(fd, &d->opts, false, OPbefore)) {
+            const int err = errno;
+            statsend(NSconnect, d->attemptstart, err);
+            tracesockop(false, fd, ai->ai_addr, ai->ai_addrlen, err);
+            close(fd);
+            errno = err;
+            continue;
+        }
+
+        const bool connected = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        if ((connected || errno == EINPROGRESS) &&
+            applyopts(fd, &d->opts, false, OPafter)) {
+            if (connected) {
+                statsend(NSconnect, d->attemptstart, 0);
+                tracesockop(false, fd, ai->ai_addr, ai->ai_addrlen, 0);
+            }
+            d->fd = fd;
+            d->cur = ai;
+            d->connected = connected;
+            return true;
+        }
+
+        const int err = errno;
+        statsend(NSconnect, d->attemptstart, err);
+        tracesockop(false, fd, ai->ai_addr, ai->ai_addrlen, err);
+        close(fd);
+        errno = err;
+    }
+
+    return false;
+}
+
+/* Switches a socket connected in non-blocking mode to blocking, if requested. */
+static int
+dialdone(int fd, int flags)
+{
+    if (flags & NDblocking) {
+        const int fl = fcntl(fd, F_GETFL);
+        if (fl == -1 || fcntl(fd, F_SETFL, fl & ~O_NONBLOCK) == -1)
+            goto beach;
+    }
+
+    return fd;
+
+beach:
+    close(fd);
+    return -1;
+}
+
+static struct netdialer*
+dialstart(const char *address, int flags, uint64_t start)
+{
+    struct netaddr na;
+    if (!netaddrparse(address, &na)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct netdialer *d = calloc(1, sizeof(struct netdialer));
+    if (!d)
+        return NULL;
+
+    d->fd = -1;
+    d->start = start;
+
+    if (na.family == AF_UNIX) {
+        /* Unix sockets connect immediately, or fail right away. */
+        d->flags = flags;
+        d->fd = unixsocket(&na, flags & ~NDblocking, connect);
+        statsend(NSconnect, start, (d->fd == -1) ? errno : 0);
+        if (d->fd == -1) {
+            const int err = errno;
+            freedialer(d);
+            errno = err;
+            return NULL;
+        }
+        d->connected = true;
+        return d;
+    }
+
+    d->flags = flags & ~NDunixoptmask;
+    d->opts = na.opts;
+
+    int errcode;
+    if (!(d->ra = netaddrinfo(&na, &errcode, false))) {
+        free(d);
+        return NULL;
+    }
+    if (na.numeric && !(d->ra = addrinfodup(d->ra))) {
+        free(d);
+        return NULL;
+    }
+
+    d->ai = d->ra = interleaveaddrinfo(d->ra);
+    if (!dialnext(d)) {
+        const int err = errno;
+        freedialer(d);
+        errno = err;
+        return NULL;
+    }
+
+    return d;
+}
+
+struct netdialer*
+netdialstart(const char *address, int flags)
+{
+    const uint64_t start = statsstart();
+    struct netdialer *d = dialstart(address, flags, start);
+    if (!d)
+        statsend(NSdial, start, errno);
+    return d;
+}
+
+int
+netdialfd(const struct netdialer *d)
+{
+    assert(d);
+    return d->fd;
+}
+
+int
+netdialfinish(struct netdialer *d)
+{
+    assert(d);
+
+    while (!d->connected) {
+        struct pollfd pfd = { .fd = d->fd, .events = POLLOUT };
+        const int r = poll(&pfd, 1, 0);
+        if (r == 0 || (r == -1 && errno == EINTR)) {
+            errno = EINPROGRESS;
+            return -1;
+        }
+
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (r == -1 || getsockopt(d->fd, SOL_SOCKET, SO_ERROR, &err, &errlen))
+            err = errno;
+
+        statsend(NSconnect, d->attemptstart, err);
+        tracesockop(false, d->fd, d->cur->ai_addr, d->cur->ai_addrlen, err);
+        if (err == 0) {
+            d->connected = true;
+            break;
+        }
+
+        /* Candidate failed, fall back to the next one (if any). */
+        close(d->fd);
+        d->fd = -1;
+
+        if (!dialnext(d)) {
+            statsend(NSdial, d->start, err);
+            freedialer(d);
+            errno = err;
+            return -1;
+        }
+    }
+
+    const int fd = d->fd;
+    const int flags = d->flags;
+    const uint64_t start = d->start;
+    freedialer(d);
+
+    const int result = dialdone(fd, flags);
+    statsend(NSdial, start, (result == -1) ? errno : 0);
+    return result;
+}
+
+void
+netdialcancel(struct netdialer *d)
+{
+    assert(d);
+
+    if (d->fd != -1) {
+        /* Abandoned attempts are not failures, but traces pair them. */
+        if (!d->connected)
+            tracesockop(false, d->fd, d->cur->ai_addr, d->cur->ai_addrlen, ECANCELED);
+        close(d->fd);
+    }
+    freedialer(d);
+}
+
+enum {
+    /* Connection Attempt Delay, RFC 8305 section 5. */
+    NDattemptdelay = 250,  /* ms */
+    NDmaxattempts  = 32,   /* In progress at the same time. */
+};
+
+static int
+dialtimeout(const char *address, int flags, int timeout)
+{
+    struct netaddr na;
+    if (!netaddrparse(address, &na)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Unix sockets do not need racing, connecting never takes long. */
+    if (na.family == AF_UNIX)
+        return dialaddr(&na, NULL, flags);
+
+    flags &= ~NDunixoptmask;
+
+    const int64_t deadline = (timeout < 0) ? INT64_MAX : nowms() + timeout;
+
+    int errcode;
+    struct addrinfo *ra = netaddrinfo(&na, &errcode, false);
+    if (!ra)
+        return -1;
+    ra = interleaveaddrinfo(ra);
+
+    unsigned ncandidates = 0;
+    for (const struct addrinfo *ai = ra; ai && ncandidates < NDmaxattempts; ai = ai->ai_next)
+        ncandidates++;
+
+    int sockflags = SOCK_NONBLOCK;
+    if (!(flags & NDexeckeep))
+        sockflags |= SOCK_CLOEXEC;
+
+    struct pollfd pfd[ncandidates];
+    struct {
+        uint64_t start;  /* For statistics. */
+        const struct addrinfo *ai;
+    } attempt[ncandidates];  /* Parallel to "pfd". */
+    unsigned npending = 0;
+
+    const struct addrinfo *ai = ra;
+    int64_t nextattempt = 0;
+    int fd = -1, err = ETIMEDOUT;
+
+    for (;;) {
+        int64_t now = nowms();
+
+        /* Start the next attempt when due, or right away if none pending. */
+        while (ai && npending < ncandidates && (npending == 0 || now >= nextattempt)) {
+            const struct addrinfo *cur = ai;
+            ai = ai->ai_next;
+
+            const uint64_t start = statsstart();
+            const int sfd = socket(cur->ai_family,
+                                   cur->ai_socktype | sockflags,
+                                   cur->ai_protocol);
+            if (sfd == -1) {
+                err = errno;
+                statsend(NSconnect, start, err);
+                continue;
+            }
+
+            TRACE(connect__start, .event = NTconnectstart, .fd = sfd,
+                  .sa = cur->ai_addr, .salen = cur->ai_addrlen);
+
+            if (!applyflags(sfd, flags) || !applyopts(sfd, &na.opts, false, OPbefore)) {
+                err = errno;
+                statsend(NSconnect, start, err);
+                tracesockop(false, sfd, cur->ai_addr, cur->ai_addrlen, err);
+                close(sfd);
+                continue;
+            }
+
+            const bool connected = connect(sfd, cur->ai_addr, cur->ai_addrlen) == 0;
+            if ((!connected && errno != EINPROGRESS) ||
+                !applyopts(sfd, &na.opts, false, OPafter)) {
+                err = errno;
+                statsend(NSconnect, start, err);
+                tracesockop(false, sfd, cur->ai_addr, cur->ai_addrlen, err);
+                close(sfd);
+                continue;
+            }
+            if (connected) {
+                statsend(NSconnect, start, 0);
+                tracesockop(false, sfd, cur->ai_addr, cur->ai_addrlen, 0);
+                fd = sfd;
+                goto done;
+            }
+
+            attempt[npending].start = start;
+            attempt[npending].ai = cur;
+            pfd[npending++] = (struct pollfd) { .fd = sfd, .events = POLLOUT };
+            nextattempt = now + NDattemptdelay;
+        }
+
+        if (npending == 0)
+            goto done;
+
+        if (now >= deadline) {
+            err = ETIMEDOUT;
+            goto done;
+        }
+
+        int64_t wait = deadline - now;
+        if (ai && npending < ncandidates && nextattempt - now < wait)
+            wait = nextattempt - now;
+
+        const int r = poll(pfd, npending, (wait > INT_MAX) ? -1 : (int) wait);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            err = errno;
+            goto done;
+        }
+
+        for (unsigned i = 0; i < npending && r > 0;) {
+            if (!pfd[i].revents) {
+                i++;
+                continue;
+            }
+
+            int soerr = 0;
+            socklen_t soerrlen = sizeof(soerr);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &soerrlen))
+                soerr = errno;
+
+            statsend(NSconnect, attempt[i].start, soerr);
+            tracesockop(false, pfd[i].fd, attempt[i].ai->ai_addr,
+                        attempt[i].ai->ai_addrlen, soerr);
+            if (soerr == 0) {
+                /* First one to complete wins. */
+                fd = pfd[i].fd;
+                attempt[i] = attempt[npending - 1];
+                pfd[i] = pfd[--npending];
+                goto done;
+            }
+
+            err = soerr;
+            close(pfd[i].fd);
+            attempt[i] = attempt[npending - 1];
+            pfd[i] = pfd[--npending];
+
+            /* A failure starts the next attempt without waiting. */
+            nextattempt = 0;
+        }
+    }
+
+done:
+    /* Attempts still in progress failed too, unless another one won. */
+    for (unsigned i = 0; i < npending; i++) {
+        if (fd == -1)
+            statsend(NSconnect, attempt[i].start, err);
+        tracesockop(false, pfd[i].fd, attempt[i].ai->ai_addr, attempt[i].ai->ai_addrlen,
+                    (fd == -1) ? err : ECANCELED);
+        close(pfd[i].fd);
+    }
+    netfreeaddrinfo(&na, ra);
+
+    if (fd == -1) {
+        errno = err;
+        return -1;
+    }
+
+    return dialdone(fd, flags);
+}
+
+int
+netdialtimeout(const char *address, int flags, int timeout)
+{
+    const uint64_t start = statsstart();
+    const int fd = dialtimeout(address, flags, timeout);
+    statsend(NSdial, start, (fd == -1) ? errno : 0);
+    return fd;
+}
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif /* !MSG_CMSG_CLOEXEC */
+
+enum {
+    /* First socket passed with socket activation, see sd_listen_fds(3). */
+    NDlistenfdsstart = 3,
+
+    /* Sockets passed in each message by nethandoff(). */
+    NDhandoffbatch = 64,
+};
+
+/*
+ * Sockets inherited from a previous process, waiting to be adopted by
+ * announceaddr(). Those passed with socket activation are added the first
+ * time they are looked for.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    int *fds;
+    unsigned nfds;
+    unsigned size;
+} inherited = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+/* Must be called with the lock held. */
+static bool
+inheritadd(int fd)
+{
+    if (inherited.nfds == inherited.size) {
+        const unsigned size = inherited.size ? inherited.size * 2 : 8;
+        int *fds = realloc(inherited.fds, size * sizeof(int));
+        if (!fds)
+            return false;
+        inherited.fds = fds;
+        inherited.size = size;
+    }
+
+    inherited.fds[inherited.nfds++] = fd;
+    return true;
+}
+
+/* Parses a whole string as a number in the [1, max] range. */
+static bool
+parseenvnum(const char *s, long max, long *value)
+{
+    if (!s || *s < '0' || *s > '9')
+        return false;
+
+    char *end;
+    errno = 0;
+    const long v = strtol(s, &end, 10);
+    if (errno || *end || v < 1 || v > max)
+        return false;
+
+    *value = v;
+    return true;
+}
+
+static void
+inheritinit(void)
+{
+    const int saved = errno;
+
+    /* Like sd_listen_fds(), the sockets must be meant for this process. */
+    long pid, n;
+    if (!parseenvnum(getenv("LISTEN_PID"), LONG_MAX, &pid) || pid != (long) getpid() ||
+        !parseenvnum(getenv("LISTEN_FDS"), INT_MAX - NDlistenfdsstart, &n)) {
+        errno = saved;
+        return;
+    }
+
+    pthread_mutex_lock(&inherited.lock);
+    for (long i = 0; i < n; i++) {
+        const int fd = NDlistenfdsstart + i;
+        /* Like sd_listen_fds(), do not leak them if never adopted. */
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 || !inheritadd(fd))
+            break;
+    }
+    pthread_mutex_unlock(&inherited.lock);
+
+    errno = saved;
+}
+
+static bool
+sockaddrmatch(const struct sockaddr_storage *ss, const struct sockaddr *sa)
+{
+    if (ss->ss_family != sa->sa_family)
+        return false;
+
+    switch (sa->sa_family) {
+        case AF_INET: {
+            const struct sockaddr_in *a = (const struct sockaddr_in*) ss;
+            const struct sockaddr_in *b = (const struct sockaddr_in*) sa;
+            return a->sin_port == b->sin_port &&
+                   a->sin_addr.s_addr == b->sin_addr.s_addr;
+        }
+        case AF_INET6: {
+            const struct sockaddr_in6 *a = (const struct sockaddr_in6*) ss;
+            const struct sockaddr_in6 *b = (const struct sockaddr_in6*) sa;
+            return a->sin6_port == b->sin6_port &&
+                   a->sin6_scope_id == b->sin6_scope_id &&
+                   !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+        }
+        default:
+            return false;
+    }
+}
+
+/* Checks whether "fd" is a socket announced for the given address. */
+static bool
+inheritmatch(int fd, const struct netaddr *na, const struct addrinfo *ra)
+{
+    int value;
+    socklen_t len = sizeof(value);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &value, &len) || value != na->socktype)
+        return false;
+
+    len = sizeof(value);
+    if (na->socktype != SOCK_DGRAM &&
+        (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &len) || !value))
+        return false;
+
+    struct sockaddr_storage ss;
+    len = sizeof(ss);
+    if (getsockname(fd, (struct sockaddr*) &ss, &len))
+        return false;
+
+    if (na->family == AF_UNIX) {
+        const struct sockaddr_un *sun = (const struct sockaddr_un*) &ss;
+        return ss.ss_family == AF_UNIX &&
+               strnlen(sun->sun_path, sizeof(sun->sun_path)) == na->addrlen &&
+               !memcmp(sun->sun_path, na->address, na->addrlen);
+    }
+
+    for (const struct addrinfo *ai = ra; ai; ai = ai->ai_next)
+        if (sockaddrmatch(&ss, ai->ai_addr))
+            return true;
+    return false;
+}
+
+/*
+ * Takes an inherited socket matching the address out of the list, and sets
+ * it up as if it had been just created. Fails with ENOENT if there is none.
+ */
+static int
+inheritadopt(const struct netaddr *na, const struct addrinfo *ra, int flags, int backlog)
+{
+    pthread_once(&inherited.once, inheritinit);
+
+    struct addrinfo *resolved = NULL;
+    if (na->family != AF_UNIX && !ra) {
+        int errcode;
+        if (!(ra = resolved = netaddrinfo(na, &errcode, true)))
+            return -1;
+    }
+
+    int fd = -1;
+    pthread_mutex_lock(&inherited.lock);
+    for (unsigned i = 0; i < inherited.nfds; i++) {
+        if (inheritmatch(inherited.fds[i], na, ra)) {
+            fd = inherited.fds[i];
+            inherited.fds[i] = inherited.fds[--inherited.nfds];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inherited.lock);
+
+    if (resolved)
+        netfreeaddrinfo(na, resolved);
+
+    if (fd == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Listening again only updates the backlog. */
+    const int fl = fcntl(fd, F_GETFL);
+    if (fl == -1 ||
+        fcntl(fd, F_SETFL, (flags & NDblocking) ? fl & ~O_NONBLOCK : fl | O_NONBLOCK) == -1 ||
+        fcntl(fd, F_SETFD, (flags & NDexeckeep) ? 0 : FD_CLOEXEC) == -1 ||
+        (na->socktype != SOCK_DGRAM && listen(fd, (backlog > 0) ? backlog : 5) == -1)) {
+        const int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    TRACE(listen, .event = NTlisten, .fd = fd);
+    return fd;
+}
+
+int
+netinherit(int fd)
+{
+    pthread_once(&inherited.once, inheritinit);
+
+    unsigned n = 0;
+    for (;;) {
+        union {
+            char buf[CMSG_SPACE(sizeof(int) * NDhandoffbatch)];
+            struct cmsghdr align;
+        } control;
+        char more;
+        struct iovec iov = { .iov_base = &more, .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+        };
+
+        const ssize_t r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1)
+            return -1;
+        if (r == 0) {
+            /* Closed before the last batch. */
+            errno = EPIPE;
+            return -1;
+        }
+
+        pthread_mutex_lock(&inherited.lock);
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            const unsigned count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (unsigned i = 0; i < count; i++) {
+                int sfd;
+                memcpy(&sfd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+                if (!MSG_CMSG_CLOEXEC)
+                    fcntl(sfd, F_SETFD, FD_CLOEXEC);
+                if (inheritadd(sfd))
+                    n++;
+                else
+                    close(sfd);
+            }
+        }
+        pthread_mutex_unlock(&inherited.lock);
+
+        if (msg.msg_flags & MSG_CTRUNC) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (!more)
+            return n;
+    }
+}
+
+void
+netinheritflush(void)
+{
+    pthread_once(&inherited.once, inheritinit);
+
+    pthread_mutex_lock(&inherited.lock);
+    for (unsigned i = 0; i < inherited.nfds; i++)
+        close(inherited.fds[i]);
+    free(inherited.fds);
+    inherited.fds = NULL;
+    inherited.nfds = inherited.size = 0;
+    pthread_mutex_unlock(&inherited.lock);
+}
+
+int
+nethandoff(int fd, const int *fds, unsigned nfds)
+{
+    assert(fds || !nfds);
+
+    /* Batches carry a byte which tells whether more follow. */
+    unsigned sent = 0;
+    for (;;) {
+        const unsigned batch = (nfds - sent < NDhandoffbatch) ? nfds - sent : NDhandoffbatch;
+        char more = (sent + batch < nfds);
+
+        union {
+            char buf[CMSG_SPACE(sizeof(int) * NDhandoffbatch)];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = { .iov_base = &more, .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+        };
+
+        if (batch) {
+            msg.msg_control = control.buf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * batch);
+
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN(sizeof(int) * batch);
+            memcpy(CMSG_DATA(cm), fds + sent, sizeof(int) * batch);
+        }
+
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if ((sent += batch) == nfds)
+            return 0;
+    }
+}
+
+static int
+announceaddr(const struct netaddr *na, const struct addrinfo *ra,
+             int flags, int backlog)
+{
+    if (flags & NDinherit) {
+        const int fd = inheritadopt(na, ra, flags, backlog);
+        if (fd != -1 || errno != ENOENT)
+            return fd;
+    }
+
+    int fd;
+    if (na->family == AF_UNIX) {
+        fd = unixsocket(na, flags, bind);
+    } else {
+        flags &= ~NDunixoptmask;
+        fd = inetsocket(na, ra, flags, bind);
+    }
+
+    if (fd == -1)
+        return -1;
+
+    if (backlog <= 0)
+        backlog = 5;
+
+    /* The queue of pending Fast Open requests is sized like the backlog. */
+    if ((flags & NDfastopen) && TCP_FASTOPEN &&
+        na->family != AF_UNIX && na->socktype == SOCK_STREAM &&
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &backlog, sizeof(backlog)))
+        goto beach;
+
+    /* Datagram sockets receive data once bound, there is nothing to listen for. */
+    if (na->socktype != SOCK_DGRAM) {
+        const int r = listen(fd, backlog);
+        TRACE(listen, .event = NTlisten, .fd = fd, .err = r ? errno : 0);
+        if (r)
+            goto beach;
+    }
+
+    if (!applyopts(fd, &na->opts, true, OPafter))
+        goto beach;
+
+    return fd;
+
+beach: {
+        const int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+}
+
+int
+netannounce(const char *address, int flags, int backlog)
+{
+    struct netaddr na;
+    if (!netaddrparse(address, &na)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return announceaddr(&na, NULL, flags, backlog);
+}
+
+static unsigned
+sockaddrport(const struct sockaddr *sa)
+{
+    switch (sa->sa_family) {
+        case AF_INET:
+            return ntohs(((const struct sockaddr_in*) sa)->sin_port);
+        case AF_INET6:
+            return ntohs(((const struct sockaddr_in6*) sa)->sin6_port);
+        default:
+            return 0;
+    }
+}
+
+int
+netannouncegroup(const char *address, int flags, int backlog,
+                 unsigned nshards, int *fds)
+{
+    assert(fds);
+
+    /*
+     * Steering picks sockets by their order in the group, and adopted ones
+     * keep the order of the process which created them.
+     */
+    struct netaddr na;
+    if (!nshards || !netaddrparse(address, &na) || na.family == AF_UNIX ||
+        ((flags & NDinherit) && (flags & NDcpusteer))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#if !defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (flags & NDcpusteer) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif /* !SO_ATTACH_REUSEPORT_CBPF */
+
+    /* Resolve only once, all the sockets must bind the same address. */
+    int errcode;
+    struct addrinfo *ra = netaddrinfo(&na, &errcode, true);
+    if (!ra)
+        return -1;
+
+    const struct addrinfo *shardai = ra;
+    struct sockaddr_storage bound;
+    struct addrinfo boundai;
+
+    unsigned n = 0;
+    for (; n < nshards; n++) {
+        if ((fds[n] = announceaddr(&na, shardai, flags | NDreuseport, backlog)) == -1)
+            goto beach;
+
+        /*
+         * With port zero each socket would get its own ephemeral port, and
+         * there would be no group: the rest bind to the first one's port.
+         */
+        if (n == 0 && sockaddrport(ra->ai_addr) == 0) {
+            socklen_t len = sizeof(bound);
+            if (getsockname(fds[0], (struct sockaddr*) &bound, &len)) {
+                n++;
+                goto beach;
+            }
+            boundai = (struct addrinfo) {
+                .ai_family = bound.ss_family,
+                .ai_socktype = na.socktype,
+                .ai_protocol = ra->ai_protocol,
+                .ai_addr = (struct sockaddr*) &bound,
+                .ai_addrlen = len,
+            };
+            shardai = &boundai;
+        }
+    }
+
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (flags & NDcpusteer) {
+        /*
+         * Sockets are added to the group in the same order they start
+         * listening, so picking the index from the CPU handling the
+         * incoming connection steers it to fds[cpu % nshards].
+         */
+        struct sock_filter code[] = {
+            { BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+            { BPF_ALU | BPF_MOD | BPF_K, 0, 0, nshards },
+            { BPF_RET | BPF_A,           0, 0, 0 },
+        };
+        const struct sock_fprog prog = {
+            .len = nelem(code),
+            .filter = code,
+        };
+        if (setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+            goto beach;
+    }
+#endif /* SO_ATTACH_REUSEPORT_CBPF */
+
+    netfreeaddrinfo(&na, ra);
+    return 0;
+
+beach: {
+        const int err = errno;
+        while (n--)
+            close(fds[n]);
+        netfreeaddrinfo(&na, ra);
+        errno = err;
+        return -1;
+    }
+}
+
+struct ndaddr {
+    struct netaddr na;
+    struct addrinfo *ra;   /* Resolved addresses, if any. */
+    int kind;              /* Kind the addresses were resolved for. */
+};
+
+struct ndaddr*
+ndaddr_parse(const char *address)
+{
+    struct ndaddr *addr = malloc(sizeof(struct ndaddr));
+    if (!addr)
+        return NULL;
+
+    if (!netaddrparse(address, &addr->na)) {
+        free(addr);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    addr->ra = NULL;
+    return addr;
+}
+
+int
+ndaddr_resolve(struct ndaddr *addr, int kind)
+{
+    assert(addr);
+
+    if (kind != NDlocal && kind != NDremote) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Unix socket addresses need no resolving. */
+    if (addr->na.family == AF_UNIX)
+        return 0;
+
+    int errcode;
+    struct addrinfo *ra = netaddrinfo(&addr->na, &errcode, kind == NDlocal);
+    if (!ra)
+        return -1;
+
+    if (addr->ra)
+        netfreeaddrinfo(&addr->na, addr->ra);
+    addr->ra = ra;
+    addr->kind = kind;
+    return 0;
+}
+
+void
+ndaddr_free(struct ndaddr *addr)
+{
+    assert(addr);
+
+    if (addr->ra)
+        netfreeaddrinfo(&addr->na, addr->ra);
+    free(addr);
+}
+
+int
+netdial_addr(const struct ndaddr *addr, int flags)
+{
+    assert(addr);
+
+    return dialaddr(&addr->na, (addr->ra && addr->kind == NDremote) ? addr->ra : NULL, flags);
+}
+
+int
+netannounce_addr(const struct ndaddr *addr, int flags, int backlog)
+{
+    assert(addr);
+
+    return announceaddr(&addr->na, (addr->ra && addr->kind == NDlocal) ? addr->ra : NULL,
+                        flags, backlog);
+}
+
+static int
+getsocktype(int fd)
+{
+    int socktype;
+    socklen_t socktypelen = sizeof(socktype);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &socktype, &socktypelen))
+        socktype = SOCK_STREAM;
+    return socktype;
+}
+
+/*
+ * Formats an address into a buffer without allocating memory. IPv6 zones
+ * are written using the interface index, which avoids a system call.
+ */
+static bool
+fmtaddr(char *buf, size_t size,
+        const struct sockaddr_storage *sa, socklen_t salen, int socktype)
+{
+    const char *netname = getnetname(sa->ss_family, socktype);
+    if (!netname) {
+        errno = EAFNOSUPPORT;
+        return false;
+    }
+
+    int len;
+    switch (sa->ss_family) {
+        case AF_UNIX: {
+            const struct sockaddr_un *sun = (const struct sockaddr_un*) sa;
+            const size_t pathmax = (salen > offsetof(struct sockaddr_un, sun_path))
+                ? salen - offsetof(struct sockaddr_un, sun_path) : 0;
+            const size_t pathlen = strnlen(sun->sun_path,
+                                           pathmax < sizeof(sun->sun_path) ? pathmax : sizeof(sun->sun_path));
+            len = snprintf(buf, size, "%s:%.*s", netname, (int) pathlen, sun->sun_path);
+            break;
+        }
+        case AF_INET: {
+            const struct sockaddr_in *sin = (const struct sockaddr_in*) sa;
+            char host[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+            len = snprintf(buf, size, "%s:%s:%u", netname, host, ntohs(sin->sin_port));
+            break;
+        }
+        case AF_INET6: {
+            const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*) sa;
+            char host[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+            if (sin6->sin6_scope_id) {
+                len = snprintf(buf, size, "%s:[%s%%%" PRIu32 "]:%u", netname, host,
+                               sin6->sin6_scope_id, ntohs(sin6->sin6_port));
+            } else {
+                len = snprintf(buf, size, "%s:[%s]:%u", netname, host,
+                               ntohs(sin6->sin6_port));
+            }
+            break;
+        }
+        default:
+            errno = EAFNOSUPPORT;
+            return false;
+    }
+
+    if (len < 0 || (size_t) len >= size) {
+        errno = ERANGE;
+        return false;
+    }
+    return true;
+}
+
+static bool
+fmtnetaddr(char *buf, size_t size,
+           const struct sockaddr_storage *sa, socklen_t salen, int socktype)
+{
+    assert(buf);
+    assert(sa);
+
+    const uint64_t start = statsstart();
+    const bool ok = fmtaddr(buf, size, sa, salen, socktype);
+    statsend(NSformat, start, ok ? 0 : errno);
+    return ok;
+}
+
+static char*
+mknetaddr(int fd, const struct sockaddr_storage *sa, socklen_t salen)
+{
+    assert(sa);
+
+    char buf[NDaddrmax];
+    if (!fmtnetaddr(buf, sizeof(buf), sa, salen, getsocktype(fd)))
+        return NULL;
+
+    return strdup(buf);
+}
+
+int
+netaddrstr(const struct sockaddr_storage *sa, int socktype, char *address, size_t size)
+{
+    if (!sa || !address) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return fmtnetaddr(address, size, sa, sizeof(struct sockaddr_storage), socktype) ? 0 : -1;
+}
+
+/* Accepting nothing without blocking is not an error, and not recorded. */
+static inline void
+statsaccept(uint64_t start, int fd)
+{
+    if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    statsend(NSaccept, start, (fd == -1) ? errno : 0);
+}
+
+static inline void
+traceaccept(int fd, const void *sa, socklen_t salen)
+{
+    if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    TRACE(accept, .event = NTaccept, .fd = fd, .err = (fd == -1) ? errno : 0,
+          .sa = (fd == -1) ? NULL : sa, .salen = (fd == -1) ? 0 : salen);
+}
+
+static inline int
+acceptflags(int flags)
+{
+    return ((flags & NDblocking) ? 0 : SOCK_NONBLOCK) |
+           ((flags & NDexeckeep) ? 0 : SOCK_CLOEXEC);
+}
+
+int
+netaccept(int fd, int flags, char **remoteaddr)
+{
+    struct sockaddr_storage sa = {};
+    socklen_t salen = sizeof(sa);
+    const uint64_t start = statsstart();
+    int nfd = accept4(fd, (struct sockaddr*) &sa, &salen, acceptflags(flags));
+    statsaccept(start, nfd);
+    traceaccept(nfd, &sa, salen);
     if (nfd == -1)
         return -1;
 
@@ -443,7 +2756,80 @@ netaccept(int fd, int flags, char **remoteaddr)
 }
 
 int
-nethangup(int fd, int flags)
+netaccept_r(int fd, int flags, char *remoteaddr, size_t size)
+{
+    if (!remoteaddr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    const uint64_t start = statsstart();
+    int nfd = accept4(fd, (struct sockaddr*) &sa, &salen, acceptflags(flags));
+    statsaccept(start, nfd);
+    traceaccept(nfd, &sa, salen);
+    if (nfd == -1)
+        return -1;
+
+    /* Only connection-oriented sockets can be accepted, and for IP that is TCP. */
+    const int socktype = (sa.ss_family == AF_UNIX) ? getsocktype(nfd) : SOCK_STREAM;
+
+    if (!fmtnetaddr(remoteaddr, size, &sa, salen, socktype)) {
+        const int err = errno;
+        close(nfd);
+        errno = err;
+        return -1;
+    }
+
+    return nfd;
+}
+
+int
+netacceptmany(int fd, int flags, int *fds, struct sockaddr_storage *addrs, unsigned max)
+{
+    assert(fds);
+
+    if (max == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const int sockflags = acceptflags(flags);
+    const uint64_t start = statsstart();
+
+    unsigned n = 0;
+    for (; n < max; n++) {
+        struct sockaddr *sa = NULL;
+        socklen_t salen = 0;
+        if (addrs) {
+            addrs[n].ss_family = AF_UNSPEC;
+            sa = (struct sockaddr*) &addrs[n];
+            salen = sizeof(struct sockaddr_storage);
+        }
+
+        if ((fds[n] = accept4(fd, sa, &salen, sockflags)) == -1) {
+            /* Report errors only when no connection was accepted. */
+            if (n == 0) {
+                statsaccept(start, -1);
+                traceaccept(-1, NULL, 0);
+                return -1;
+            }
+            break;
+        }
+        traceaccept(fds[n], sa, salen);
+
+        /* Ensure Unix socket paths are always NUL-terminated. */
+        if (addrs && salen < sizeof(struct sockaddr_storage))
+            memset((uint8_t*) sa + salen, 0, sizeof(struct sockaddr_storage) - salen);
+    }
+
+    statsaccept(start, 0);
+    return n;
+}
+
+static int
+hangup(int fd, int flags)
 {
     switch (flags & NDrdwr) {
         /* Half-close. */
@@ -487,15 +2873,18 @@ nethangup(int fd, int flags)
 }
 
 int
-netaddress(int fd, int kind, char **address)
+nethangup(int fd, int flags)
 {
-    if ((kind != NDlocal && kind != NDremote) || !address) {
-        errno = EINVAL;
-        return -1;
-    }
+    const uint64_t start = statsstart();
+    const int r = hangup(fd, flags);
+    statsend(NShangup, start, r ? errno : 0);
+    TRACE(hangup, .event = NThangup, .fd = fd, .err = r ? errno : 0);
+    return r;
+}
 
-    struct sockaddr_storage sa = {};
-    socklen_t salen = sizeof(sa);
+static int
+getaddr(int fd, int kind, struct sockaddr_storage *sa, socklen_t *salen)
+{
     int (*getname)(int, struct sockaddr*, socklen_t*) = NULL;
 
     switch (kind) {
@@ -510,8 +2899,168 @@ netaddress(int fd, int kind, char **address)
             abort();
     }
 
-    if ((*getname)(fd, (struct sockaddr*) &sa, &salen) == -1)
+    *salen = sizeof(*sa);
+    return (*getname)(fd, (struct sockaddr*) sa, salen);
+}
+
+int
+netaddress(int fd, int kind, char **address)
+{
+    if ((kind != NDlocal && kind != NDremote) || !address) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    if (getaddr(fd, kind, &sa, &salen) == -1)
         return -1;
 
     return (*address = mknetaddr(fd, &sa, salen)) ? 0 : -1;
 }
+
+int
+netaddress_r(int fd, int kind, char *address, size_t size)
+{
+    if ((kind != NDlocal && kind != NDremote) || !address) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    if (getaddr(fd, kind, &sa, &salen) == -1)
+        return -1;
+
+    return fmtnetaddr(address, size, &sa, salen, getsocktype(fd)) ? 0 : -1;
+}
+
+#if defined(__linux__) && defined(TCP_INFO)
+/*
+ * Layout of "struct tcp_info" used by Linux. The one from the C library may
+ * lack the newer fields; the kernel only ever appends fields, and copies as
+ * many as fit in the given length, which tells which ones were filled.
+ */
+struct tcpinfo {
+    uint8_t state, ca_state, retransmits, probes, backoff, options, wscale, flags;
+    uint32_t rto, ato, snd_mss, rcv_mss;
+    uint32_t unacked, sacked, lost, retrans, fackets;
+    uint32_t last_data_sent, last_ack_sent, last_data_recv, last_ack_recv;
+    uint32_t pmtu, rcv_ssthresh, rtt, rttvar, snd_ssthresh, snd_cwnd, advmss, reordering;
+    uint32_t rcv_rtt, rcv_space;
+    uint32_t total_retrans;
+    uint64_t pacing_rate, max_pacing_rate, bytes_acked, bytes_received;
+    uint32_t segs_out, segs_in;
+    uint32_t notsent_bytes, min_rtt, data_segs_in, data_segs_out;
+    uint64_t delivery_rate;
+};
+
+#define tcpinfohas(len, field) \
+    ((len) >= offsetof(struct tcpinfo, field) + sizeof(((struct tcpinfo*) 0)->field))
+
+enum {
+    NDtcplisten = 10,  /* TCP_LISTEN in the kernel. */
+};
+
+/* Fills the TCP fields, returns false if "fd" is not a TCP socket. */
+static bool
+gettcpinfo(int fd, struct ndinfo *info)
+{
+    struct tcpinfo ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len))
+        return false;
+
+    info->socktype = SOCK_STREAM;
+    if (ti.state == NDtcplisten) {
+        /* Listening sockets report their accept queue instead. */
+        info->listening = true;
+        info->acceptq = ti.unacked;
+        info->backlog = ti.sacked;
+        return true;
+    }
+
+    info->rtt = ti.rtt;
+    info->rttvar = ti.rttvar;
+    info->mss = ti.snd_mss;
+    info->cwnd = ti.snd_cwnd;
+    info->unacked = ti.unacked;
+    info->lost = ti.lost;
+    info->retransmits = ti.total_retrans;
+    if (tcpinfohas(len, min_rtt)) {
+        info->notsent = ti.notsent_bytes;
+        info->minrtt = ti.min_rtt;
+    }
+    if (tcpinfohas(len, delivery_rate))
+        info->deliveryrate = ti.delivery_rate;
+    return true;
+}
+#else
+static inline bool
+gettcpinfo(int fd, struct ndinfo *info)
+{
+    (void) fd;
+    (void) info;
+    return false;
+}
+#endif /* __linux__ && TCP_INFO */
+
+int
+netinfo(int fd, struct ndinfo *info)
+{
+    if (!info) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *info = (struct ndinfo) { .pid = -1, .uid = -1, .gid = -1 };
+
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    if (getsockname(fd, (struct sockaddr*) &sa, &salen))
+        return -1;
+    info->family = sa.ss_family;
+
+    /* For TCP a single call provides most of the information. */
+    const bool inet = (sa.ss_family == AF_INET || sa.ss_family == AF_INET6);
+    if (!inet || !gettcpinfo(fd, info)) {
+        int value;
+        socklen_t len = sizeof(value);
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &value, &len))
+            return -1;
+        info->socktype = value;
+
+        len = sizeof(value);
+        if (info->socktype != SOCK_DGRAM &&
+            !getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &len))
+            info->listening = !!value;
+    }
+
+    /* Listening sockets have no data queued. */
+    if (info->listening)
+        return 0;
+
+    int value;
+    if (!ioctl(fd, SIOCINQ, &value) && value > 0)
+        info->inq = value;
+    if (SIOCOUTQ && !ioctl(fd, SIOCOUTQ, &value) && value > 0)
+        info->outq = value;
+
+#if defined(__linux__) && defined(SO_PEERCRED)
+    if (sa.ss_family == AF_UNIX) {
+        /* Same layout as "struct ucred", which needs _GNU_SOURCE. */
+        struct {
+            int32_t pid;
+            uint32_t uid, gid;
+        } cred;
+        socklen_t len = sizeof(cred);
+        if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.pid > 0) {
+            info->pid = cred.pid;
+            info->uid = cred.uid;
+            info->gid = cred.gid;
+        }
+    }
+#endif /* __linux__ && SO_PEERCRED */
+
+    return 0;
+}
@@ -8,11 +8,17 @@
 #ifndef NETDIAL_H
 #define NETDIAL_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 enum {
     NDdefault   = 0,
 
     NDblocking  = 1 << 1,
     NDexeckeep  = 1 << 2,
+    NDcpusteer  = 1 << 3,
+    NDfastopen  = 1 << 4,
+    NDinherit   = 1 << 5,
 
     /* Unix socket flags. */
     NDpasscred  = 1 << 9,
@@ -24,6 +30,9 @@ enum {
     NDkeepalive = 1 << 19,
     NDreuseaddr = 1 << 20,
     NDreuseport = 1 << 21,
+    NDzerocopy  = 1 << 22,
+    NDudpgro    = 1 << 23,
+    NDtimestamp = 1 << 24,
 };
 
 enum {
@@ -40,10 +49,162 @@ enum {
     NDremote,
 };
 
+enum {
+    /* Buffer size which fits any address string. */
+    NDaddrmax = 128,
+};
+
+enum {
+    /* Operations measured by netstats. */
+    NSresolve,   /* Name resolution with getaddrinfo(). */
+    NSconnect,   /* Each connection attempt, until established or failed. */
+    NSdial,      /* Whole dial, including resolution and all attempts. */
+    NSaccept,
+    NSformat,    /* Formatting of address strings. */
+    NShangup,
+    NSopmax,
+};
+
+enum {
+    /* Error classes counted by netstats. */
+    NSerrtimeout,   /* ETIMEDOUT */
+    NSerrrefused,   /* ECONNREFUSED */
+    NSerrunreach,   /* ENETUNREACH, EHOSTUNREACH, EADDRNOTAVAIL */
+    NSerrreset,     /* ECONNRESET, ECONNABORTED, EPIPE */
+    NSerrlimit,     /* EMFILE, ENFILE, ENOBUFS, ENOMEM */
+    NSerrresolve,   /* Name resolution failures. */
+    NSerrother,
+    NSerrmax,
+};
+
+enum {
+    /* Histogram buckets, eight per power of two nanoseconds. */
+    NShistbuckets = 256,
+};
+
+enum {
+    /* Events reported by tracing. */
+    NTresolvestart,
+    NTresolvedone,
+    NTconnectstart,  /* Each connection attempt. */
+    NTconnectdone,
+    NTbind,
+    NTlisten,
+    NTaccept,
+    NThangup,
+};
+
+struct netdialer;
+struct ndaddr;
+struct sockaddr;
+struct sockaddr_storage;
+
+struct netcachestats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned entries;
+};
+
+struct nethistogram {
+    unsigned long count;
+    unsigned long long sum;  /* Nanoseconds. */
+    unsigned long long max;  /* Nanoseconds. */
+    unsigned long buckets[NShistbuckets];
+};
+
+struct netstats {
+    struct {
+        unsigned long calls;
+        unsigned long errors;
+        struct nethistogram latency;
+    } op[NSopmax];
+    unsigned long errors[NSerrmax];
+};
+
+struct nettrace {
+    int event;
+    int fd;                     /* -1 if there is none. */
+    int err;                    /* errno, or EAI_* code for resolution. */
+    const char *node;           /* Resolution events only. */
+    const char *service;
+    const struct sockaddr *sa;  /* NULL if there is none. */
+    unsigned salen;
+};
+
+typedef void (*nettracefn)(const struct nettrace *event, void *data);
+
+struct ndinfo {
+    int family;
+    int socktype;
+    bool listening;
+
+    /* Bytes waiting to be read, and written but not yet sent or acknowledged. */
+    unsigned inq;
+    unsigned outq;
+
+    /* Listening TCP sockets: connections waiting to be accepted, and maximum. */
+    unsigned acceptq;
+    unsigned backlog;
+
+    /* TCP connections. */
+    unsigned rtt;                     /* Smoothed, microseconds. */
+    unsigned rttvar;                  /* Microseconds. */
+    unsigned minrtt;                  /* Microseconds. */
+    unsigned mss;                     /* Bytes. */
+    unsigned cwnd;                    /* Segments. */
+    unsigned unacked;                 /* Segments. */
+    unsigned lost;                    /* Segments. */
+    unsigned retransmits;             /* Segments, total. */
+    unsigned notsent;                 /* Bytes. */
+    unsigned long long deliveryrate;  /* Bytes per second. */
+
+    /* Unix sockets: credentials of the peer, -1 if unknown. */
+    long pid;
+    long uid;
+    long gid;
+};
+
 extern int netdial(const char *address, int flags);
+extern int netdialtimeout(const char *address, int flags, int timeout);
+extern int netdialsend(const char *address, int flags, const void *buf, size_t *len);
+extern struct netdialer* netdialstart(const char *address, int flags);
+extern int netdialfd(const struct netdialer *dialer);
+extern int netdialfinish(struct netdialer *dialer);
+extern void netdialcancel(struct netdialer *dialer);
 extern int netannounce(const char *address, int flags, int backlog);
+extern int netannouncegroup(const char *address, int flags, int backlog,
+                            unsigned nshards, int *fds);
 extern int netaccept(int fd, int flags, char **remoteaddr);
+extern int netaccept_r(int fd, int flags, char *remoteaddr, size_t size);
+extern int netacceptmany(int fd, int flags, int *fds,
+                         struct sockaddr_storage *addrs, unsigned max);
 extern int nethangup(int fd, int flags);
 extern int netaddress(int fd, int kind, char **address);
+extern int netaddress_r(int fd, int kind, char *address, size_t size);
+extern int netaddrstr(const struct sockaddr_storage *sa, int socktype,
+                      char *address, size_t size);
+extern int netinfo(int fd, struct ndinfo *info);
+
+extern struct ndaddr* ndaddr_parse(const char *address);
+extern int ndaddr_resolve(struct ndaddr *addr, int kind);
+extern void ndaddr_free(struct ndaddr *addr);
+extern int netdial_addr(const struct ndaddr *addr, int flags);
+extern int netannounce_addr(const struct ndaddr *addr, int flags, int backlog);
+
+extern int netinherit(int fd);
+extern void netinheritflush(void);
+extern int nethandoff(int fd, const int *fds, unsigned nfds);
+
+extern void netcacheconfig(unsigned size, unsigned ttl, unsigned negttl);
+extern void netcacheflush(void);
+extern void netcachestats(struct netcachestats *stats);
+
+extern void netstatsconfig(bool enable);
+extern void netstats_snapshot(struct netstats *stats);
+extern void netstats_reset(void);
+extern unsigned long long netstats_percentile(const struct nethistogram *hist, double p);
+
+extern void nettraceconfig(nettracefn fn, void *data);
 
 #endif /* !NETDIAL_H */
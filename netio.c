@@ -0,0 +1,1034 @@
+/*
+ * netio.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE
+
+#include "netio.h"
+#include "netdial.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif /* !MSG_ZEROCOPY */
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif /* !UDP_SEGMENT */
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif /* !UDP_GRO */
+
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif /* !SOL_UDP */
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif /* !SO_EE_ORIGIN_ZEROCOPY */
+
+#ifndef nelem
+#define nelem(v) (sizeof(v) / sizeof(v[0]))
+#endif /* !nelem */
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif /* !IOV_MAX */
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif /* !SO_EE_CODE_ZEROCOPY_COPIED */
+
+#ifndef SO_EE_ORIGIN_TIMESTAMPING
+#define SO_EE_ORIGIN_TIMESTAMPING 4
+#endif /* !SO_EE_ORIGIN_TIMESTAMPING */
+
+enum {
+    /* Bytes moved in one direction before giving a turn to the other. */
+    NDrelaychunk = 256 * 1024,
+
+    /* Messages passed to each recvmmsg() and sendmmsg() call. */
+    NDbatchmax = 64,
+
+    /* Minimum size of the buffers where ndwq_add() copies data. */
+    NDwqchunk = 4096,
+};
+
+struct ndpipe {
+    int fds[2];
+    size_t pending;  /* Bytes read into the pipe, not yet written out. */
+};
+
+/*
+ * Partial progress is reported as success. Errors are only reported when
+ * no data could be moved, the next call will find the error condition again.
+ */
+static inline ssize_t
+progress(size_t done)
+{
+    return done ? (ssize_t) done : -1;
+}
+
+ssize_t
+netsendfile(int fd, int infd, off_t *offset, size_t count)
+{
+    struct stat st;
+    if (fstat(infd, &st) == -1)
+        return -1;
+
+    /* Pipes can be spliced directly into the socket. */
+    const bool fifo = S_ISFIFO(st.st_mode);
+    if (fifo && offset) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < count) {
+        const ssize_t r = fifo
+            ? splice(infd, NULL, fd, NULL, count - done, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+            : sendfile(fd, infd, offset, count - done);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            return progress(done);
+        }
+        if (r == 0)  /* End of file. */
+            break;
+        done += r;
+    }
+
+    return done;
+}
+
+struct ndpipe*
+ndpipe_new(size_t size)
+{
+    struct ndpipe *p = malloc(sizeof(struct ndpipe));
+    if (!p)
+        return NULL;
+
+    if (pipe2(p->fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+        free(p);
+        return NULL;
+    }
+
+    /* Larger pipes let each splice() move more data. */
+    if (size && fcntl(p->fds[1], F_SETPIPE_SZ, (int) size) == -1) {
+        const int err = errno;
+        ndpipe_free(p);
+        errno = err;
+        return NULL;
+    }
+
+    p->pending = 0;
+    return p;
+}
+
+void
+ndpipe_free(struct ndpipe *p)
+{
+    assert(p);
+
+    close(p->fds[0]);
+    close(p->fds[1]);
+    free(p);
+}
+
+size_t
+ndpipe_pending(const struct ndpipe *p)
+{
+    assert(p);
+
+    return p->pending;
+}
+
+ssize_t
+netsplice(int infd, int outfd, size_t count, struct ndpipe *p)
+{
+    assert(p);
+
+    size_t done = 0;
+    for (;;) {
+        /* Data left in the pipe by a previous call goes out first. */
+        while (p->pending) {
+            const ssize_t r = splice(p->fds[0], NULL, outfd, NULL, p->pending,
+                                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (r == -1) {
+                if (errno == EINTR)
+                    continue;
+                return progress(done);
+            }
+            p->pending -= r;
+            done += r;
+        }
+
+        if (done >= count)
+            break;
+
+        const ssize_t r = splice(infd, NULL, p->fds[1], NULL, count - done,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            return progress(done);
+        }
+        if (r == 0)  /* End of file. */
+            break;
+        p->pending += r;
+    }
+
+    return done;
+}
+
+ssize_t
+netsendzc(int fd, const void *buf, size_t len)
+{
+    ssize_t r;
+    do {
+        r = send(fd, buf, len, MSG_ZEROCOPY);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+static inline uint64_t
+tsns(const struct timespec *ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* Takes the timestamps from a control message, if it carries them. */
+static bool
+iststamp(const struct cmsghdr *cm, struct ndtstamp *ts)
+{
+    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPING)
+        return false;
+
+    /* Software timestamps come first, raw hardware ones third. */
+    struct scm_timestamping st;
+    memcpy(&st, CMSG_DATA(cm), sizeof(st));
+    ts->sw = tsns(&st.ts[0]);
+    ts->hw = tsns(&st.ts[2]);
+    return true;
+}
+
+ssize_t
+netrecvts(int fd, void *buf, size_t len, struct sockaddr_storage *addr, struct ndtstamp *ts)
+{
+    assert(buf || !len);
+    assert(ts);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_name = addr,
+        .msg_namelen = addr ? sizeof(*addr) : 0,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t r;
+    do {
+        r = recvmsg(fd, &msg, 0);
+    } while (r == -1 && errno == EINTR);
+    if (r == -1)
+        return -1;
+
+    *ts = (struct ndtstamp) {};
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        iststamp(cm, ts);
+
+    return r;
+}
+
+/*
+ * Reads one message from the error queue. Returns 1 if it was stored into
+ * "m", 0 if it is of no interest, and -1 on error.
+ */
+static int
+errqread(int fd, struct nderrq *m)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+                 CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in6))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    /* Reading from the error queue never blocks. */
+    ssize_t r;
+    do {
+        r = recvmsg(fd, &msg, MSG_ERRQUEUE);
+    } while (r == -1 && errno == EINTR);
+    if (r == -1)
+        return -1;
+
+    /* Timestamps come in their own message, next to the extended error. */
+    const struct sock_extended_err *ee = NULL;
+    struct ndtstamp ts = {};
+    bool hasts = false;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (iststamp(cm, &ts))
+            hasts = true;
+        else if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+            ee = (const void*) CMSG_DATA(cm);
+    }
+    if (!ee)
+        return 0;
+
+    *m = (struct nderrq) {};
+
+    if (ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY && ee->ee_errno == 0) {
+        m->kind = NDerrqzc;
+        m->zc.lo = ee->ee_info;
+        m->zc.hi = ee->ee_data;
+        m->zc.copied = ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+        return 1;
+    }
+
+    if (ee->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && ee->ee_errno == ENOMSG) {
+        switch (ee->ee_info) {
+            case SCM_TSTAMP_SCHED:
+                m->tx.kind = NDtxsched;
+                break;
+            case SCM_TSTAMP_SND:
+                m->tx.kind = NDtxsent;
+                break;
+            case SCM_TSTAMP_ACK:
+                m->tx.kind = NDtxacked;
+                break;
+            default:
+                return 0;
+        }
+        if (!hasts)
+            return 0;
+        m->kind = NDerrqtx;
+        m->tx.ts = ts;
+        m->tx.id = ee->ee_data;
+        return 1;
+    }
+
+    if (ee->ee_errno == 0)
+        return 0;
+
+    m->kind = NDerrqerror;
+    m->err = ee->ee_errno;
+    return 1;
+}
+
+/*
+ * The error queue cannot be peeked (MSG_PEEK is ignored along MSG_ERRQUEUE),
+ * so errors read after other messages are kept here until the next call.
+ * Sockets are told apart by inode, file descriptors may be reused.
+ */
+static struct {
+    pthread_mutex_t lock;
+    atomic_uint count;
+    struct errqheld {
+        dev_t dev;
+        ino_t ino;
+        int err;
+    } *items;
+    unsigned size;
+} errqheld = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+errqhold(int fd, int err)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+        return;
+
+    pthread_mutex_lock(&errqheld.lock);
+    const unsigned count = atomic_load_explicit(&errqheld.count, memory_order_relaxed);
+    if (count == errqheld.size) {
+        const unsigned size = errqheld.size ? errqheld.size * 2 : 4;
+        struct errqheld *items = realloc(errqheld.items, size * sizeof(struct errqheld));
+        if (!items)
+            goto beach;
+        errqheld.items = items;
+        errqheld.size = size;
+    }
+    errqheld.items[count] = (struct errqheld) { .dev = st.st_dev, .ino = st.st_ino, .err = err };
+    atomic_store_explicit(&errqheld.count, count + 1, memory_order_relaxed);
+beach:
+    pthread_mutex_unlock(&errqheld.lock);
+}
+
+/* Takes the error kept for a socket, if any. */
+static bool
+errqtake(int fd, int *err)
+{
+    if (!atomic_load_explicit(&errqheld.count, memory_order_relaxed))
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st))
+        return false;
+
+    bool found = false;
+    pthread_mutex_lock(&errqheld.lock);
+    const unsigned count = atomic_load_explicit(&errqheld.count, memory_order_relaxed);
+    for (unsigned i = 0; i < count; i++) {
+        if (errqheld.items[i].dev == st.st_dev && errqheld.items[i].ino == st.st_ino) {
+            *err = errqheld.items[i].err;
+            errqheld.items[i] = errqheld.items[count - 1];
+            atomic_store_explicit(&errqheld.count, count - 1, memory_order_relaxed);
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&errqheld.lock);
+    return found;
+}
+
+int
+neterrqreap(int fd, struct nderrq *msgs, unsigned max)
+{
+    assert(msgs);
+    assert(max > 0);
+
+    unsigned n = 0;
+    int err;
+    if (errqtake(fd, &err))
+        msgs[n++] = (struct nderrq) { .kind = NDerrqerror, .err = err };
+
+    while (n < max) {
+        const int r = errqread(fd, &msgs[n]);
+        if (r == -1)
+            break;
+        n += r;
+    }
+
+    return n ? (int) n : -1;
+}
+
+/*
+ * The reapers for a single kind of message drop those of other kinds. An
+ * error stops reaping, and is reported right away if nothing was read
+ * before it, or by the next call otherwise.
+ */
+int
+netzcreap(int fd, struct ndzcdone *done, unsigned max)
+{
+    assert(done);
+    assert(max > 0);
+
+    int err;
+    if (errqtake(fd, &err)) {
+        errno = err;
+        return -1;
+    }
+
+    unsigned n = 0;
+    while (n < max) {
+        struct nderrq m;
+        const int r = errqread(fd, &m);
+        if (r == -1)
+            break;
+        if (r == 0)
+            continue;
+
+        if (m.kind == NDerrqzc) {
+            done[n++] = m.zc;
+        } else if (m.kind == NDerrqerror) {
+            if (n) {
+                errqhold(fd, m.err);
+                break;
+            }
+            errno = m.err;
+            return -1;
+        }
+    }
+
+    return n ? (int) n : -1;
+}
+
+int
+nettsreap(int fd, struct ndtxstamp *stamps, unsigned max)
+{
+    assert(stamps);
+    assert(max > 0);
+
+    int err;
+    if (errqtake(fd, &err)) {
+        errno = err;
+        return -1;
+    }
+
+    unsigned n = 0;
+    while (n < max) {
+        struct nderrq m;
+        const int r = errqread(fd, &m);
+        if (r == -1)
+            break;
+        if (r == 0)
+            continue;
+
+        if (m.kind == NDerrqtx) {
+            stamps[n++] = m.tx;
+        } else if (m.kind == NDerrqerror) {
+            if (n) {
+                errqhold(fd, m.err);
+                break;
+            }
+            errno = m.err;
+            return -1;
+        }
+    }
+
+    return n ? (int) n : -1;
+}
+
+static socklen_t
+addrlen(const struct sockaddr_storage *sa)
+{
+    switch (sa->ss_family) {
+        case AF_INET:
+            return sizeof(struct sockaddr_in);
+        case AF_INET6:
+            return sizeof(struct sockaddr_in6);
+        default:
+            return 0;
+    }
+}
+
+int
+netrecvmany(int fd, void *arena, size_t slotsize, struct ndpacket *pkts, unsigned max)
+{
+    assert(arena);
+    assert(slotsize > 0);
+    assert(pkts);
+
+    /* Otherwise "errno" would be left as it was. */
+    if (!max)
+        return 0;
+
+    unsigned n = 0;
+    while (n < max) {
+        const unsigned batch = (max - n < NDbatchmax) ? max - n : NDbatchmax;
+
+        struct mmsghdr msgs[NDbatchmax];
+        struct iovec iov[NDbatchmax];
+        union {
+            char buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct scm_timestamping))];
+            struct cmsghdr align;
+        } control[NDbatchmax];
+
+        for (unsigned i = 0; i < batch; i++) {
+            struct ndpacket *p = &pkts[n + i];
+            iov[i] = (struct iovec) {
+                .iov_base = (char*) arena + (n + i) * slotsize,
+                .iov_len = slotsize,
+            };
+            msgs[i] = (struct mmsghdr) {
+                .msg_hdr = {
+                    .msg_name = &p->addr,
+                    .msg_namelen = sizeof(p->addr),
+                    .msg_iov = &iov[i],
+                    .msg_iovlen = 1,
+                    .msg_control = control[i].buf,
+                    .msg_controllen = sizeof(control[i].buf),
+                },
+            };
+        }
+
+        /* Only wait for the first datagram, then take what is queued. */
+        const int r = recvmmsg(fd, msgs, batch, n ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < r; i++) {
+            struct ndpacket *p = &pkts[n + i];
+            p->data = iov[i].iov_base;
+            p->len = msgs[i].msg_len;
+            p->segsize = 0;
+            p->ts = (struct ndtstamp) {};
+
+            struct msghdr *msg = &msgs[i].msg_hdr;
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+                if (iststamp(cm, &p->ts))
+                    continue;
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    int segsize;
+                    memcpy(&segsize, CMSG_DATA(cm), sizeof(segsize));
+                    p->segsize = segsize;
+                }
+            }
+        }
+
+        n += r;
+        if ((unsigned) r < batch)
+            break;
+    }
+
+    return n ? (int) n : -1;
+}
+
+int
+netsendmany(int fd, const struct ndpacket *pkts, unsigned count)
+{
+    assert(pkts);
+
+    if (!count)
+        return 0;
+
+    unsigned n = 0;
+    while (n < count) {
+        const unsigned batch = (count - n < NDbatchmax) ? count - n : NDbatchmax;
+
+        struct mmsghdr msgs[NDbatchmax];
+        struct iovec iov[NDbatchmax];
+        union {
+            char buf[CMSG_SPACE(sizeof(uint16_t))];
+            struct cmsghdr align;
+        } control[NDbatchmax];
+
+        for (unsigned i = 0; i < batch; i++) {
+            const struct ndpacket *p = &pkts[n + i];
+            const socklen_t namelen = addrlen(&p->addr);
+
+            iov[i] = (struct iovec) { .iov_base = p->data, .iov_len = p->len };
+            msgs[i] = (struct mmsghdr) {
+                .msg_hdr = {
+                    .msg_name = namelen ? (void*) &p->addr : NULL,
+                    .msg_namelen = namelen,
+                    .msg_iov = &iov[i],
+                    .msg_iovlen = 1,
+                },
+            };
+
+            /* The kernel splits the data in datagrams of segsize bytes. */
+            if (p->segsize) {
+                struct msghdr *msg = &msgs[i].msg_hdr;
+                msg->msg_control = control[i].buf;
+                msg->msg_controllen = sizeof(control[i].buf);
+
+                struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+                const uint16_t segsize = p->segsize;
+                memcpy(CMSG_DATA(cm), &segsize, sizeof(segsize));
+            }
+        }
+
+        const int r = sendmmsg(fd, msgs, batch, 0);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        n += r;
+        if ((unsigned) r < batch)
+            break;
+    }
+
+    return n ? (int) n : -1;
+}
+
+struct relaydir {
+    int in, out;
+    struct ndpipe *pipe;
+    bool done;
+};
+
+struct ndrelay {
+    struct relaydir dir[2];
+    int err;  /* First error, if any. */
+};
+
+struct ndrelay*
+ndrelay_new(int fda, int fdb, size_t pipesize)
+{
+    struct ndrelay *r = calloc(1, sizeof(struct ndrelay));
+    if (!r)
+        return NULL;
+
+    r->dir[0] = (struct relaydir) { .in = fda, .out = fdb };
+    r->dir[1] = (struct relaydir) { .in = fdb, .out = fda };
+
+    for (unsigned i = 0; i < 2; i++) {
+        if (!(r->dir[i].pipe = ndpipe_new(pipesize))) {
+            const int err = errno;
+            ndrelay_free(r);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    return r;
+}
+
+void
+ndrelay_free(struct ndrelay *r)
+{
+    assert(r);
+
+    for (unsigned i = 0; i < 2; i++)
+        if (r->dir[i].pipe)
+            ndpipe_free(r->dir[i].pipe);
+    free(r);
+}
+
+/*
+ * A direction finishes when its input reaches the end, which is passed on
+ * as a half-close of the output, or on errors, after which neither end is
+ * used anymore for this direction. Errors from shutdown() are ignored, as
+ * the other end may be gone already.
+ */
+static void
+finishdir(struct ndrelay *r, struct relaydir *d, int err)
+{
+    d->done = true;
+
+    if (err) {
+        if (!r->err)
+            r->err = err;
+        nethangup(d->in, NDread);
+    }
+    nethangup(d->out, NDwrite);
+}
+
+int
+ndrelay_step(struct ndrelay *r)
+{
+    assert(r);
+
+    /*
+     * Alternate between directions until both would block, which makes
+     * this usable with edge-triggered notifications.
+     */
+    bool moved;
+    do {
+        moved = false;
+        for (unsigned i = 0; i < 2; i++) {
+            struct relaydir *d = &r->dir[i];
+            if (d->done)
+                continue;
+
+            const ssize_t n = netsplice(d->in, d->out, NDrelaychunk, d->pipe);
+            if (n > 0)
+                moved = true;
+            else if (n == 0)
+                finishdir(r, d, 0);
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                finishdir(r, d, errno);
+        }
+    } while (moved);
+
+    if (!r->dir[0].done || !r->dir[1].done)
+        return 1;
+
+    if (r->err) {
+        errno = r->err;
+        return -1;
+    }
+    return 0;
+}
+
+short
+ndrelay_events(const struct ndrelay *r, int fd)
+{
+    assert(r);
+
+    short events = 0;
+    for (unsigned i = 0; i < 2; i++) {
+        const struct relaydir *d = &r->dir[i];
+        if (d->done)
+            continue;
+
+        /* Pending data needs the output, otherwise wait for more input. */
+        if (d->pipe->pending) {
+            if (d->out == fd)
+                events |= POLLOUT;
+        } else if (d->in == fd) {
+            events |= POLLIN;
+        }
+    }
+    return events;
+}
+
+int
+netrelay(int fda, int fdb, size_t pipesize)
+{
+    struct ndrelay *r = ndrelay_new(fda, fdb, pipesize);
+    if (!r)
+        return -1;
+
+    int ret;
+    while ((ret = ndrelay_step(r)) == 1) {
+        struct pollfd pfd[2] = {
+            { .fd = fda, .events = ndrelay_events(r, fda) },
+            { .fd = fdb, .events = ndrelay_events(r, fdb) },
+        };
+
+        /* Negative descriptors are ignored by poll(). */
+        for (unsigned i = 0; i < 2; i++)
+            if (!pfd[i].events)
+                pfd[i].fd = -1;
+
+        if (poll(pfd, 2, -1) == -1 && errno != EINTR) {
+            ret = -1;
+            break;
+        }
+    }
+
+    const int err = errno;
+    ndrelay_free(r);
+    errno = err;
+    return ret;
+}
+
+struct wqseg {
+    struct wqseg *next;
+    const uint8_t *data;
+    size_t len;
+    size_t cap;  /* Size of .buf for copied data, zero for references. */
+    ndwq_releasefn release;
+    void *releasedata;
+    uint8_t buf[];
+};
+
+struct ndwq {
+    struct wqseg *head, *tail;
+    size_t off;      /* Bytes of the first segment already written. */
+    size_t pending;
+    size_t lowat, hiwat;
+    bool full;
+    bool notsock;    /* Use writev(), sendmsg() failed with ENOTSOCK. */
+};
+
+struct ndwq*
+ndwq_new(size_t lowat, size_t hiwat)
+{
+    assert(!hiwat || lowat <= hiwat);
+
+    struct ndwq *q = calloc(1, sizeof(struct ndwq));
+    if (!q)
+        return NULL;
+
+    q->lowat = lowat;
+    q->hiwat = hiwat;
+    return q;
+}
+
+static void
+wqpush(struct ndwq *q, struct wqseg *seg)
+{
+    if (q->tail)
+        q->tail->next = seg;
+    else
+        q->head = seg;
+    q->tail = seg;
+}
+
+static void
+wqpop(struct ndwq *q)
+{
+    struct wqseg *seg = q->head;
+    if (!(q->head = seg->next))
+        q->tail = NULL;
+    q->off = 0;
+
+    if (seg->release)
+        (*seg->release)(seg->releasedata);
+    free(seg);
+}
+
+void
+ndwq_free(struct ndwq *q)
+{
+    assert(q);
+
+    while (q->head)
+        wqpop(q);
+    free(q);
+}
+
+static void
+wqadded(struct ndwq *q, size_t len)
+{
+    q->pending += len;
+    if (q->hiwat && q->pending >= q->hiwat)
+        q->full = true;
+}
+
+int
+ndwq_add(struct ndwq *q, const void *buf, size_t len)
+{
+    assert(q);
+    assert(buf || !len);
+
+    /* Fill up the spare room of the last copied segment first. */
+    struct wqseg *tail = q->tail;
+    if (tail && tail->cap > tail->len) {
+        const size_t n = (len < tail->cap - tail->len) ? len : tail->cap - tail->len;
+        memcpy(tail->buf + tail->len, buf, n);
+        tail->len += n;
+        wqadded(q, n);
+        buf = (const uint8_t*) buf + n;
+        len -= n;
+    }
+
+    if (!len)
+        return 0;
+
+    const size_t cap = (len > NDwqchunk) ? len : NDwqchunk;
+    struct wqseg *seg = malloc(sizeof(struct wqseg) + cap);
+    if (!seg)
+        return -1;
+
+    *seg = (struct wqseg) { .data = seg->buf, .len = len, .cap = cap };
+    memcpy(seg->buf, buf, len);
+    wqpush(q, seg);
+    wqadded(q, len);
+    return 0;
+}
+
+int
+ndwq_addref(struct ndwq *q, const void *buf, size_t len,
+            ndwq_releasefn release, void *data)
+{
+    assert(q);
+    assert(buf || !len);
+
+    if (!len) {
+        if (release)
+            (*release)(data);
+        return 0;
+    }
+
+    struct wqseg *seg = malloc(sizeof(struct wqseg));
+    if (!seg)
+        return -1;
+
+    *seg = (struct wqseg) {
+        .data = buf,
+        .len = len,
+        .release = release,
+        .releasedata = data,
+    };
+    wqpush(q, seg);
+    wqadded(q, len);
+    return 0;
+}
+
+/* Drops "n" written bytes from the front of the queue. */
+static void
+wqconsume(struct ndwq *q, size_t n)
+{
+    q->pending -= n;
+    while (n) {
+        const size_t left = q->head->len - q->off;
+        if (n < left) {
+            q->off += n;
+            break;
+        }
+        n -= left;
+        wqpop(q);
+    }
+}
+
+ssize_t
+ndwq_flush(struct ndwq *q, int fd)
+{
+    assert(q);
+
+    size_t done = 0;
+    while (q->head) {
+        struct iovec iov[IOV_MAX];
+        unsigned n = 0;
+        size_t len = 0;
+
+        size_t off = q->off;
+        for (struct wqseg *seg = q->head; seg && n < nelem(iov); seg = seg->next) {
+            iov[n++] = (struct iovec) {
+                .iov_base = (void*) (seg->data + off),
+                .iov_len = seg->len - off,
+            };
+            len += seg->len - off;
+            off = 0;
+        }
+
+        /* sendmsg() avoids SIGPIPE, writev() works with any file. */
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        const ssize_t w = q->notsock ? writev(fd, iov, n)
+                                     : sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (w == -1) {
+            if (errno == ENOTSOCK && !q->notsock) {
+                q->notsock = true;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        wqconsume(q, w);
+        done += w;
+
+        /* A short write means that the output is full. */
+        if ((size_t) w < len)
+            break;
+    }
+
+    if (q->full && q->pending <= q->lowat)
+        q->full = false;
+
+    return q->head ? progress(done) : (ssize_t) done;
+}
+
+size_t
+ndwq_pending(const struct ndwq *q)
+{
+    assert(q);
+
+    return q->pending;
+}
+
+bool
+ndwq_full(const struct ndwq *q)
+{
+    assert(q);
+
+    return q->full;
+}
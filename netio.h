@@ -0,0 +1,109 @@
+/*
+ * netio.h
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+struct ndpipe;
+struct ndrelay;
+struct ndwq;
+
+typedef void (*ndwq_releasefn)(void *data);
+
+enum {
+    /* Kinds of transmit timestamps. */
+    NDtxsched,  /* Data entered the packet scheduler. */
+    NDtxsent,   /* Data was passed to the network device. */
+    NDtxacked,  /* Data was acknowledged by the peer, TCP only. */
+};
+
+struct ndtstamp {
+    /* Nanoseconds since the epoch, zero if unavailable. */
+    uint64_t sw;  /* Taken by the kernel. */
+    uint64_t hw;  /* Taken by the network device. */
+};
+
+struct ndtxstamp {
+    struct ndtstamp ts;
+    uint32_t id;  /* Datagram number, or byte offset for TCP. */
+    int kind;
+};
+
+enum {
+    /* Kinds of error queue messages. */
+    NDerrqzc,     /* Zero-copy completion, in "zc". */
+    NDerrqtx,     /* Transmit timestamp, in "tx". */
+    NDerrqerror,  /* Error (e.g. from ICMP), in "err". */
+};
+
+struct ndpacket {
+    void *data;
+    size_t len;
+    unsigned segsize;  /* GSO/GRO segment size, zero if unused. */
+    struct ndtstamp ts;  /* Receive time, with NDtimestamp. */
+    struct sockaddr_storage addr;
+};
+
+struct ndzcdone {
+    uint32_t lo, hi;  /* Range of completed sends, both inclusive. */
+    bool copied;      /* The kernel copied the data instead. */
+};
+
+struct nderrq {
+    int kind;
+    int err;
+    struct ndzcdone zc;
+    struct ndtxstamp tx;
+};
+
+extern ssize_t netsendfile(int fd, int infd, off_t *offset, size_t count);
+extern ssize_t netsplice(int infd, int outfd, size_t count, struct ndpipe *pipe);
+extern ssize_t netsendzc(int fd, const void *buf, size_t len);
+extern ssize_t netrecvts(int fd, void *buf, size_t len,
+                         struct sockaddr_storage *addr, struct ndtstamp *ts);
+
+/*
+ * Zero-copy completions, transmit timestamps, and errors share the socket
+ * error queue, and reading a message removes it. netzcreap() and nettsreap()
+ * drop messages of the other kind, so use neterrqreap() for sockets with both
+ * NDzerocopy and NDtimestamp. An error stops them, and is reported by the
+ * next call if other messages were read before it.
+ */
+extern int netzcreap(int fd, struct ndzcdone *done, unsigned max);
+extern int nettsreap(int fd, struct ndtxstamp *stamps, unsigned max);
+extern int neterrqreap(int fd, struct nderrq *msgs, unsigned max);
+
+extern int netrecvmany(int fd, void *arena, size_t slotsize,
+                       struct ndpacket *pkts, unsigned max);
+extern int netsendmany(int fd, const struct ndpacket *pkts, unsigned count);
+
+extern int netrelay(int fda, int fdb, size_t pipesize);
+
+extern struct ndwq* ndwq_new(size_t lowat, size_t hiwat);
+extern void ndwq_free(struct ndwq *wq);
+extern int ndwq_add(struct ndwq *wq, const void *buf, size_t len);
+extern int ndwq_addref(struct ndwq *wq, const void *buf, size_t len,
+                       ndwq_releasefn release, void *data);
+extern ssize_t ndwq_flush(struct ndwq *wq, int fd);
+extern size_t ndwq_pending(const struct ndwq *wq);
+extern bool ndwq_full(const struct ndwq *wq);
+
+extern struct ndpipe* ndpipe_new(size_t size);
+extern void ndpipe_free(struct ndpipe *pipe);
+extern size_t ndpipe_pending(const struct ndpipe *pipe);
+
+extern struct ndrelay* ndrelay_new(int fda, int fdb, size_t pipesize);
+extern void ndrelay_free(struct ndrelay *relay);
+extern int ndrelay_step(struct ndrelay *relay);
+extern short ndrelay_events(const struct ndrelay *relay, int fd);
+
+#endif /* !NETIO_H */
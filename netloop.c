@@ -0,0 +1,444 @@
+/*
+ * netloop.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _POSIX_C_SOURCE 201112L
+#define _DEFAULT_SOURCE
+
+#include "netloop.h"
+#include "netdial.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef nelem
+#define nelem(v) (sizeof(v) / sizeof(v[0]))
+#endif /* !nelem */
+
+enum {
+    NLbatchsize  = 256,  /* Events handled for each epoll_wait() call. */
+    NLacceptsize = 64,   /* Connections taken for each netacceptmany() call. */
+};
+
+/* Marks events from the eventfd used by netloop_stop(). */
+static const uint64_t wakeupmark = UINT64_MAX;
+
+struct handler {
+    netloop_fn fn;
+    void      *data;
+    void     (*release)(void*);
+    uint32_t   gen;
+};
+
+struct netloop {
+    int epfd;
+    int wakefd;
+    bool stop;
+    struct handler *handlers;  /* Indexed by file descriptor. */
+    unsigned nhandlers;
+};
+
+/*
+ * The generation counter of each handler slot is stored alongside the fd in
+ * the epoll data, so events for a file descriptor which got removed (and
+ * possibly reused) while handling a batch of events are ignored.
+ */
+static inline uint64_t
+mkevdata(int fd, uint32_t gen)
+{
+    return ((uint64_t) gen << 32) | (uint32_t) fd;
+}
+
+static inline uint32_t
+toepoll(int events)
+{
+    uint32_t ev = EPOLLET;
+    if (events & NLread)
+        ev |= EPOLLIN | EPOLLRDHUP;
+    if (events & NLwrite)
+        ev |= EPOLLOUT;
+    return ev;
+}
+
+static inline int
+fromepoll(uint32_t ev)
+{
+    int events = 0;
+    if (ev & (EPOLLIN | EPOLLRDHUP))
+        events |= NLread;
+    if (ev & EPOLLOUT)
+        events |= NLwrite;
+    if (ev & (EPOLLERR | EPOLLHUP))
+        events |= NLerror;
+    return events;
+}
+
+struct netloop*
+netloop_new(void)
+{
+    struct netloop *loop = calloc(1, sizeof(struct netloop));
+    if (!loop)
+        return NULL;
+
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        goto beach;
+
+    if ((loop->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+        close(loop->epfd);
+        goto beach;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = wakeupmark };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) == -1) {
+        close(loop->wakefd);
+        close(loop->epfd);
+        goto beach;
+    }
+
+    return loop;
+
+beach:
+    free(loop);
+    return NULL;
+}
+
+static void
+clearhandler(struct handler *h, bool release)
+{
+    if (release && h->release)
+        (*h->release)(h->data);
+
+    h->fn = NULL;
+    h->data = NULL;
+    h->release = NULL;
+    h->gen++;
+}
+
+void
+netloop_free(struct netloop *loop)
+{
+    assert(loop);
+
+    for (unsigned i = 0; i < loop->nhandlers; i++)
+        if (loop->handlers[i].fn)
+            clearhandler(&loop->handlers[i], true);
+
+    free(loop->handlers);
+    close(loop->wakefd);
+    close(loop->epfd);
+    free(loop);
+}
+
+static struct handler*
+gethandler(struct netloop *loop, int fd)
+{
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if ((unsigned) fd >= loop->nhandlers) {
+        unsigned n = loop->nhandlers ? loop->nhandlers : 64;
+        while (n <= (unsigned) fd)
+            n *= 2;
+
+        struct handler *handlers = realloc(loop->handlers, n * sizeof(struct handler));
+        if (!handlers)
+            return NULL;
+
+        memset(handlers + loop->nhandlers, 0,
+               (n - loop->nhandlers) * sizeof(struct handler));
+        loop->handlers = handlers;
+        loop->nhandlers = n;
+    }
+
+    return &loop->handlers[fd];
+}
+
+/* Checks whether the handler of "fd" is still the one of generation "gen". */
+static inline bool
+hashandler(const struct netloop *loop, int fd, uint32_t gen)
+{
+    return (unsigned) fd < loop->nhandlers && loop->handlers[fd].fn &&
+           loop->handlers[fd].gen == gen;
+}
+
+static int
+addhandler(struct netloop *loop, int fd, int events,
+           netloop_fn fn, void *data, void (*release)(void*))
+{
+    struct handler *h = gethandler(loop, fd);
+    if (!h)
+        return -1;
+
+    if (h->fn) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    struct epoll_event ev = {
+        .events = toepoll(events),
+        .data.u64 = mkevdata(fd, h->gen),
+    };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        return -1;
+
+    h->fn = fn;
+    h->data = data;
+    h->release = release;
+    return 0;
+}
+
+static int
+delhandler(struct netloop *loop, int fd, bool release)
+{
+    if (fd < 0 || (unsigned) fd >= loop->nhandlers || !loop->handlers[fd].fn) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* The fd may have been closed already, which removes it from the set. */
+    const int r = epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    const int err = errno;
+    clearhandler(&loop->handlers[fd], release);
+
+    if (r == -1 && err != EBADF && err != ENOENT) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int
+netloop_add(struct netloop *loop, int fd, int events, netloop_fn fn, void *data)
+{
+    assert(loop);
+    assert(fn);
+
+    return addhandler(loop, fd, events, fn, data, NULL);
+}
+
+int
+netloop_mod(struct netloop *loop, int fd, int events)
+{
+    assert(loop);
+
+    if (fd < 0 || (unsigned) fd >= loop->nhandlers || !loop->handlers[fd].fn) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    struct epoll_event ev = {
+        .events = toepoll(events),
+        .data.u64 = mkevdata(fd, loop->handlers[fd].gen),
+    };
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int
+netloop_del(struct netloop *loop, int fd)
+{
+    assert(loop);
+
+    return delhandler(loop, fd, true);
+}
+
+int
+netloop_run(struct netloop *loop)
+{
+    assert(loop);
+
+    struct epoll_event events[NLbatchsize];
+
+    loop->stop = false;
+    while (!loop->stop) {
+        const int n = epoll_wait(loop->epfd, events, nelem(events), -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            const uint64_t evdata = events[i].data.u64;
+            if (evdata == wakeupmark) {
+                uint64_t value;
+                while (read(loop->wakefd, &value, sizeof(value)) > 0)
+                    ;
+                loop->stop = true;
+                continue;
+            }
+
+            const int fd = (int) (uint32_t) evdata;
+            if ((unsigned) fd >= loop->nhandlers)
+                continue;
+
+            /* Handlers may add file descriptors, reallocating the table. */
+            const struct handler h = loop->handlers[fd];
+            if (!h.fn || h.gen != (uint32_t) (evdata >> 32))
+                continue;
+
+            (*h.fn)(loop, fd, fromepoll(events[i].events), h.data);
+        }
+    }
+
+    return 0;
+}
+
+void
+netloop_stop(struct netloop *loop)
+{
+    assert(loop);
+
+    /* Safe to use from signal handlers and other threads. */
+    const uint64_t value = 1;
+    while (write(loop->wakefd, &value, sizeof(value)) == -1 && errno == EINTR)
+        ;
+}
+
+struct acceptctx {
+    netloop_acceptfn fn;
+    void *data;
+    int flags;
+};
+
+static void
+acceptready(struct netloop *loop, int fd, int events, void *data)
+{
+    /*
+     * The callback may remove the handler, which frees the context: keep
+     * a copy, and stop if the handler changed after each call.
+     */
+    const struct acceptctx ctx = *(const struct acceptctx*) data;
+    const uint32_t gen = loop->handlers[fd].gen;
+
+    (void) events;
+
+    /* Edge-triggered: drain the queue of pending connections. */
+    for (;;) {
+        int fds[NLacceptsize];
+        struct sockaddr_storage addrs[NLacceptsize];
+        const int n = netacceptmany(fd, ctx.flags, fds, addrs, nelem(fds));
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                (*ctx.fn)(loop, -1, NULL, ctx.data);
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            (*ctx.fn)(loop, fds[i], &addrs[i], ctx.data);
+            if (!hashandler(loop, fd, gen)) {
+                /* Nobody is left to take the rest of connections. */
+                while (++i < n)
+                    close(fds[i]);
+                return;
+            }
+        }
+    }
+}
+
+int
+netloop_accept(struct netloop *loop, int fd, int flags,
+               netloop_acceptfn fn, void *data)
+{
+    assert(loop);
+    assert(fn);
+
+    struct acceptctx *ctx = malloc(sizeof(struct acceptctx));
+    if (!ctx)
+        return -1;
+
+    *ctx = (struct acceptctx) { .fn = fn, .data = data, .flags = flags };
+    if (addhandler(loop, fd, NLread, acceptready, ctx, free) == -1) {
+        free(ctx);
+        return -1;
+    }
+
+    /* Connections may be pending already, and no edge would be seen. */
+    acceptready(loop, fd, NLread, ctx);
+    return 0;
+}
+
+struct dialctx {
+    struct netdialer *dialer;
+    netloop_dialfn fn;
+    void *data;
+};
+
+static void
+dialrelease(void *data)
+{
+    struct dialctx *ctx = data;
+    netdialcancel(ctx->dialer);
+    free(ctx);
+}
+
+static void
+dialready(struct netloop *loop, int fd, int events, void *data)
+{
+    struct dialctx *ctx = data;
+
+    (void) events;
+
+    delhandler(loop, fd, false);
+
+    const int nfd = netdialfinish(ctx->dialer);
+    if (nfd == -1 && errno == EINPROGRESS) {
+        /* Still connecting, possibly to the next candidate address. */
+        if (addhandler(loop, netdialfd(ctx->dialer), NLwrite,
+                       dialready, ctx, dialrelease) == 0)
+            return;
+
+        const int err = errno;
+        netdialcancel(ctx->dialer);
+        errno = err;
+    }
+
+    const int err = errno;
+    netloop_dialfn fn = ctx->fn;
+    void *fndata = ctx->data;
+    free(ctx);
+
+    errno = err;
+    (*fn)(loop, nfd, fndata);
+}
+
+int
+netloop_dial(struct netloop *loop, const char *address, int flags,
+             netloop_dialfn fn, void *data)
+{
+    assert(loop);
+    assert(fn);
+
+    struct dialctx *ctx = malloc(sizeof(struct dialctx));
+    if (!ctx)
+        return -1;
+
+    if (!(ctx->dialer = netdialstart(address, flags))) {
+        free(ctx);
+        return -1;
+    }
+
+    ctx->fn = fn;
+    ctx->data = data;
+
+    if (addhandler(loop, netdialfd(ctx->dialer), NLwrite,
+                   dialready, ctx, dialrelease) == -1) {
+        const int err = errno;
+        dialrelease(ctx);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * netloop.h
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef NETLOOP_H
+#define NETLOOP_H
+
+struct netloop;
+struct sockaddr_storage;
+
+enum {
+    /* Readiness events. */
+    NLread  = 1 << 0,
+    NLwrite = 1 << 1,
+    NLerror = 1 << 2,
+};
+
+typedef void (*netloop_fn)(struct netloop *loop, int fd, int events, void *data);
+typedef void (*netloop_acceptfn)(struct netloop *loop, int fd,
+                                 const struct sockaddr_storage *remoteaddr,
+                                 void *data);
+typedef void (*netloop_dialfn)(struct netloop *loop, int fd, void *data);
+
+extern struct netloop* netloop_new(void);
+extern void netloop_free(struct netloop *loop);
+extern int netloop_add(struct netloop *loop, int fd, int events, netloop_fn fn, void *data);
+extern int netloop_mod(struct netloop *loop, int fd, int events);
+extern int netloop_del(struct netloop *loop, int fd);
+extern int netloop_run(struct netloop *loop);
+extern void netloop_stop(struct netloop *loop);
+
+extern int netloop_accept(struct netloop *loop, int fd, int flags,
+                          netloop_acceptfn fn, void *data);
+extern int netloop_dial(struct netloop *loop, const char *address, int flags,
+                        netloop_dialfn fn, void *data);
+
+#endif /* !NETLOOP_H */
@@ -0,0 +1,406 @@
+/*
+ * netpool.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _POSIX_C_SOURCE 201112L
+#define _DEFAULT_SOURCE
+
+#include "netpool.h"
+#include "netdial.h"
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+    NPbuckets   = 64,       /* Hash buckets for keys, power of two. */
+    NPchunkbits = 10,
+    NPchunksize = 1 << NPchunkbits,
+    NPmaxfds    = 1 << 24,  /* Upper limit for the size of the owner table. */
+};
+
+struct idleconn {
+    int fd;
+    int64_t since;
+};
+
+struct poolkey {
+    struct poolkey *next;
+    uint32_t hash;
+    int flags;
+    char *address;
+
+    pthread_mutex_t lock;
+    unsigned nbusy;
+    unsigned nidle;
+    unsigned long hits, misses, stale, expired, discarded;
+    struct idleconn idle[];  /* Most recently used last. */
+};
+
+typedef _Atomic(struct poolkey*) ownerslot;
+
+struct netpool {
+    unsigned maxidle;
+    unsigned maxconns;
+    int64_t idletimeout;
+
+    pthread_rwlock_t keyslock;
+    struct poolkey *keys[NPbuckets];
+
+    /*
+     * Maps checked out file descriptors to their keys, in chunks allocated
+     * on demand, which allows checking in connections without locking.
+     */
+    _Atomic(ownerslot*) *owners;
+    unsigned nchunks;
+};
+
+static int64_t
+nowms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a, with the connection type part of the address lowercased. */
+static uint32_t
+keyhash(const char *address, int flags)
+{
+    uint32_t h = 2166136261U;
+    for (unsigned i = 0; i < sizeof(flags); i++)
+        h = (h ^ ((const uint8_t*) &flags)[i]) * 16777619U;
+
+    bool type = true;
+    for (const char *p = address; *p; p++) {
+        if (*p == ':')
+            type = false;
+        h = (h ^ (uint8_t) (type ? tolower(*p) : *p)) * 16777619U;
+    }
+    return h;
+}
+
+static bool
+keymatch(const struct poolkey *key, uint32_t hash, const char *address, int flags)
+{
+    if (key->hash != hash || key->flags != flags)
+        return false;
+
+    const char *colon = strchr(address, ':');
+    const size_t typelen = colon ? (size_t) (colon - address) : strlen(address);
+    return strncasecmp(key->address, address, typelen) == 0
+        && strcmp(key->address + typelen, address + typelen) == 0;
+}
+
+struct netpool*
+netpool_new(unsigned maxidle, unsigned maxconns, unsigned idletimeout)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl))
+        return NULL;
+
+    rlim_t maxfds = rl.rlim_cur;
+    if (maxfds == RLIM_INFINITY || maxfds > NPmaxfds)
+        maxfds = NPmaxfds;
+
+    struct netpool *pool = calloc(1, sizeof(struct netpool));
+    if (!pool)
+        return NULL;
+
+    pool->nchunks = (maxfds + NPchunksize - 1) / NPchunksize;
+    if (!(pool->owners = calloc(pool->nchunks, sizeof(pool->owners[0])))) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_rwlock_init(&pool->keyslock, NULL);
+    pool->maxidle = maxidle;
+    pool->maxconns = maxconns;
+    pool->idletimeout = idletimeout;
+    return pool;
+}
+
+void
+netpool_free(struct netpool *pool)
+{
+    assert(pool);
+
+    for (unsigned i = 0; i < NPbuckets; i++) {
+        struct poolkey *key = pool->keys[i];
+        while (key) {
+            struct poolkey *next = key->next;
+            for (unsigned j = 0; j < key->nidle; j++)
+                close(key->idle[j].fd);
+            pthread_mutex_destroy(&key->lock);
+            free(key->address);
+            free(key);
+            key = next;
+        }
+    }
+
+    for (unsigned i = 0; i < pool->nchunks; i++)
+        free(atomic_load(&pool->owners[i]));
+
+    pthread_rwlock_destroy(&pool->keyslock);
+    free(pool->owners);
+    free(pool);
+}
+
+static ownerslot*
+getowner(struct netpool *pool, int fd, bool create)
+{
+    const unsigned c = (unsigned) fd >> NPchunkbits;
+    if (fd < 0 || c >= pool->nchunks)
+        return NULL;
+
+    ownerslot *chunk = atomic_load_explicit(&pool->owners[c], memory_order_acquire);
+    if (!chunk && create) {
+        ownerslot *newchunk = calloc(NPchunksize, sizeof(ownerslot));
+        if (!newchunk)
+            return NULL;
+        if (atomic_compare_exchange_strong(&pool->owners[c], &chunk, newchunk))
+            chunk = newchunk;
+        else
+            free(newchunk);  /* Another thread won, chunk points to its one. */
+    }
+
+    return chunk ? &chunk[fd & (NPchunksize - 1)] : NULL;
+}
+
+static struct poolkey*
+findkey(struct netpool *pool, uint32_t hash, const char *address, int flags)
+{
+    for (struct poolkey *key = pool->keys[hash & (NPbuckets - 1)]; key; key = key->next)
+        if (keymatch(key, hash, address, flags))
+            return key;
+    return NULL;
+}
+
+static struct poolkey*
+getkey(struct netpool *pool, const char *address, int flags)
+{
+    const uint32_t hash = keyhash(address, flags);
+
+    pthread_rwlock_rdlock(&pool->keyslock);
+    struct poolkey *key = findkey(pool, hash, address, flags);
+    pthread_rwlock_unlock(&pool->keyslock);
+    if (key)
+        return key;
+
+    pthread_rwlock_wrlock(&pool->keyslock);
+    if (!(key = findkey(pool, hash, address, flags))) {
+        key = calloc(1, sizeof(struct poolkey) + pool->maxidle * sizeof(struct idleconn));
+        if (key && !(key->address = strdup(address))) {
+            free(key);
+            key = NULL;
+        }
+        if (key) {
+            pthread_mutex_init(&key->lock, NULL);
+            key->hash = hash;
+            key->flags = flags;
+            key->next = pool->keys[hash & (NPbuckets - 1)];
+            pool->keys[hash & (NPbuckets - 1)] = key;
+        }
+    }
+    pthread_rwlock_unlock(&pool->keyslock);
+    return key;
+}
+
+/* Must be called with the key locked. Oldest connections are first. */
+static void
+expireidle(struct netpool *pool, struct poolkey *key, int64_t now)
+{
+    if (!pool->idletimeout)
+        return;
+
+    unsigned n = 0;
+    while (n < key->nidle && now - key->idle[n].since >= pool->idletimeout)
+        close(key->idle[n++].fd);
+
+    if (n) {
+        key->nidle -= n;
+        key->expired += n;
+        memmove(key->idle, key->idle + n, key->nidle * sizeof(struct idleconn));
+    }
+}
+
+/*
+ * Idle connections have nothing to read: anything else means that the peer
+ * closed the connection, an error, or unexpected data.
+ */
+static bool
+isalive(int fd)
+{
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+        && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int
+netpool_checkout(struct netpool *pool, const char *address, int flags)
+{
+    assert(pool);
+
+    if (!address) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct poolkey *key = getkey(pool, address, flags);
+    if (!key)
+        return -1;
+
+    pthread_mutex_lock(&key->lock);
+    expireidle(pool, key, nowms());
+
+    while (key->nidle) {
+        const int fd = key->idle[--key->nidle].fd;
+        if (isalive(fd)) {
+            key->hits++;
+            key->nbusy++;
+            pthread_mutex_unlock(&key->lock);
+
+            /* It was checked in, and chunks are only freed with the pool. */
+            ownerslot *owner = getowner(pool, fd, false);
+            assert(owner);
+            atomic_store_explicit(owner, key, memory_order_relaxed);
+            return fd;
+        }
+        key->stale++;
+        close(fd);
+    }
+
+    if (pool->maxconns && key->nbusy >= pool->maxconns) {
+        pthread_mutex_unlock(&key->lock);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /* Reserve the slot, and dial without holding the lock. */
+    key->misses++;
+    key->nbusy++;
+    pthread_mutex_unlock(&key->lock);
+
+    const int fd = netdial(address, flags);
+    ownerslot *owner = (fd == -1) ? NULL : getowner(pool, fd, true);
+    if (!owner) {
+        const int err = (fd == -1) ? errno : EMFILE;
+        if (fd != -1)
+            close(fd);
+
+        pthread_mutex_lock(&key->lock);
+        key->nbusy--;
+        pthread_mutex_unlock(&key->lock);
+
+        errno = err;
+        return -1;
+    }
+
+    atomic_store_explicit(owner, key, memory_order_relaxed);
+    return fd;
+}
+
+int
+netpool_checkin(struct netpool *pool, int fd, bool reuse)
+{
+    assert(pool);
+
+    ownerslot *owner = getowner(pool, fd, false);
+    struct poolkey *key = owner ? atomic_exchange(owner, NULL) : NULL;
+    if (!key) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    const int64_t now = nowms();
+
+    pthread_mutex_lock(&key->lock);
+    key->nbusy--;
+    expireidle(pool, key, now);
+
+    if (reuse && key->nidle < pool->maxidle) {
+        key->idle[key->nidle++] = (struct idleconn) { .fd = fd, .since = now };
+        pthread_mutex_unlock(&key->lock);
+        return 0;
+    }
+
+    key->discarded++;
+    pthread_mutex_unlock(&key->lock);
+    close(fd);
+    return 0;
+}
+
+void
+netpool_expire(struct netpool *pool)
+{
+    assert(pool);
+
+    const int64_t now = nowms();
+
+    pthread_rwlock_rdlock(&pool->keyslock);
+    for (unsigned i = 0; i < NPbuckets; i++) {
+        for (struct poolkey *key = pool->keys[i]; key; key = key->next) {
+            pthread_mutex_lock(&key->lock);
+            expireidle(pool, key, now);
+            pthread_mutex_unlock(&key->lock);
+        }
+    }
+    pthread_rwlock_unlock(&pool->keyslock);
+}
+
+static void
+addstats(struct netpoolstats *stats, const struct poolkey *key)
+{
+    stats->hits += key->hits;
+    stats->misses += key->misses;
+    stats->stale += key->stale;
+    stats->expired += key->expired;
+    stats->discarded += key->discarded;
+    stats->idle += key->nidle;
+    stats->busy += key->nbusy;
+}
+
+int
+netpool_stats(struct netpool *pool, const char *address, int flags,
+              struct netpoolstats *stats)
+{
+    assert(pool);
+    assert(stats);
+
+    *stats = (struct netpoolstats) { 0 };
+
+    const uint32_t hash = address ? keyhash(address, flags) : 0;
+    int found = 0;
+
+    pthread_rwlock_rdlock(&pool->keyslock);
+    for (unsigned i = 0; i < NPbuckets; i++) {
+        for (struct poolkey *key = pool->keys[i]; key; key = key->next) {
+            if (address && !keymatch(key, hash, address, flags))
+                continue;
+
+            pthread_mutex_lock(&key->lock);
+            addstats(stats, key);
+            pthread_mutex_unlock(&key->lock);
+            found++;
+        }
+    }
+    pthread_rwlock_unlock(&pool->keyslock);
+
+    if (address && !found) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * netpool.h
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef NETPOOL_H
+#define NETPOOL_H
+
+#include <stdbool.h>
+
+struct netpool;
+
+struct netpoolstats {
+    unsigned long hits;       /* Checkouts which reused an idle connection. */
+    unsigned long misses;     /* Checkouts which dialed a new connection. */
+    unsigned long stale;      /* Idle connections found closed on checkout. */
+    unsigned long expired;    /* Idle connections closed after the timeout. */
+    unsigned long discarded;  /* Connections closed on checkin. */
+    unsigned idle;
+    unsigned busy;
+};
+
+extern struct netpool* netpool_new(unsigned maxidle, unsigned maxconns, unsigned idletimeout);
+extern void netpool_free(struct netpool *pool);
+extern int netpool_checkout(struct netpool *pool, const char *address, int flags);
+extern int netpool_checkin(struct netpool *pool, int fd, bool reuse);
+extern void netpool_expire(struct netpool *pool);
+extern int netpool_stats(struct netpool *pool, const char *address, int flags,
+                         struct netpoolstats *stats);
+
+#endif /* !NETPOOL_H */
@@ -0,0 +1,971 @@
+/*
+ * netring.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _POSIX_C_SOURCE 201112L
+#define _DEFAULT_SOURCE
+
+#include "netring.h"
+#include "netdial.h"
+#include "netloop.h"
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+enum {
+    NRentries  = 256,   /* Submission queue entries. */
+    NRbufcount = 256,   /* Provided buffers, must be a power of two. */
+    NRbufsize  = 4096,  /* Size of each provided buffer. */
+    NRbufgroup = 0,
+};
+
+enum opkind {
+    OPaccept,
+    OPrecv,
+    OPsend,
+    OPwakeup,
+};
+
+/*
+ * Operations in progress. With io_uring their address is used as the
+ * user_data of the submissions; a zero user_data is used for submissions
+ * whose completions are ignored.
+ */
+struct rop {
+    enum opkind kind;
+    int fd;
+    int flags;
+    bool cancelled;
+    union {
+        netring_acceptfn accept;
+        netring_recvfn   recv;
+        netring_sendfn   send;
+    } fn;
+    void *data;
+    struct netring *ring;
+    struct rop *prev, *next;    /* List of live operations. */
+
+    /* Used by sends. */
+    struct rop *qnext;          /* Send queue, epoll backend only. */
+    unsigned pending;           /* Linked submissions yet to complete. */
+    int err;
+    ssize_t total;
+    unsigned iovcnt, iovpos;
+    struct iovec iov[];
+};
+
+struct fdstate {
+    struct rop *accept;
+    struct rop *recv;
+    struct rop *sendq, *sendqtail;  /* Epoll backend only. */
+    bool watched;                   /* Epoll backend only. */
+};
+
+struct netring {
+    bool uring;
+    bool stop;
+    int wakefd;
+    uint8_t *bufs;
+    struct rop *ops;
+    struct fdstate *fds;
+    unsigned nfds;
+
+    /* io_uring backend. */
+    int ringfd;
+    void *sqmap, *cqmap;
+    size_t sqmapsize, cqmapsize;
+    struct io_uring_sqe *sqes;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray, sqentries;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned sqlocaltail, sqsubmitted;
+    struct io_uring_buf_ring *br;
+    size_t brsize;
+    struct rop *wakeop;
+    uint64_t wakevalue;
+
+    /* Epoll backend. */
+    struct netloop *loop;
+};
+
+static struct rop*
+mkop(struct netring *ring, enum opkind kind, int fd, unsigned iovcnt)
+{
+    struct rop *op = calloc(1, sizeof(struct rop) + iovcnt * sizeof(struct iovec));
+    if (!op)
+        return NULL;
+
+    op->kind = kind;
+    op->fd = fd;
+    op->ring = ring;
+    if ((op->next = ring->ops))
+        op->next->prev = op;
+    ring->ops = op;
+    return op;
+}
+
+static void
+freeop(struct rop *op)
+{
+    if (op->prev)
+        op->prev->next = op->next;
+    else
+        op->ring->ops = op->next;
+    if (op->next)
+        op->next->prev = op->prev;
+    free(op);
+}
+
+static struct fdstate*
+getfdstate(struct netring *ring, int fd)
+{
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if ((unsigned) fd >= ring->nfds) {
+        unsigned n = ring->nfds ? ring->nfds : 64;
+        while (n <= (unsigned) fd)
+            n *= 2;
+
+        struct fdstate *fds = realloc(ring->fds, n * sizeof(struct fdstate));
+        if (!fds)
+            return NULL;
+
+        memset(fds + ring->nfds, 0, (n - ring->nfds) * sizeof(struct fdstate));
+        ring->fds = fds;
+        ring->nfds = n;
+    }
+
+    return &ring->fds[fd];
+}
+
+static inline uint8_t*
+getbuf(struct netring *ring, unsigned bid)
+{
+    return ring->bufs + (size_t) bid * NRbufsize;
+}
+
+/*
+ * io_uring backend.
+ */
+
+static inline int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+uring_enter(int fd, unsigned tosubmit, unsigned mincomplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags, NULL, 0);
+}
+
+static inline int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nargs)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static int
+uring_submit(struct netring *ring, unsigned wait)
+{
+    const unsigned tosubmit = ring->sqlocaltail - ring->sqsubmitted;
+    __atomic_store_n(ring->sqtail, ring->sqlocaltail, __ATOMIC_RELEASE);
+
+    const int r = uring_enter(ring->ringfd, tosubmit, wait,
+                              wait ? IORING_ENTER_GETEVENTS : 0);
+    if (r >= 0)
+        ring->sqsubmitted += r;
+    return r;
+}
+
+/* Ensures that "n" submission queue entries can be obtained with uring_sqe(). */
+static bool
+uring_reserve(struct netring *ring, unsigned n)
+{
+    if (n > ring->sqentries) {
+        errno = EINVAL;
+        return false;
+    }
+
+    unsigned head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+    if (ring->sqentries - (ring->sqlocaltail - head) >= n)
+        return true;
+
+    if (uring_submit(ring, 0) == -1 && errno != EBUSY && errno != EAGAIN)
+        return false;
+
+    head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+    if (ring->sqentries - (ring->sqlocaltail - head) >= n)
+        return true;
+
+    errno = EBUSY;
+    return false;
+}
+
+static struct io_uring_sqe*
+uring_sqe(struct netring *ring)
+{
+    if (!uring_reserve(ring, 1))
+        return NULL;
+
+    const unsigned idx = ring->sqlocaltail++ & *ring->sqmask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqarray[idx] = idx;
+    return sqe;
+}
+
+static void
+uring_recyclebuf(struct netring *ring, unsigned bid)
+{
+    const unsigned short tail = ring->br->tail;
+    struct io_uring_buf *buf = &ring->br->bufs[tail & (NRbufcount - 1)];
+    buf->addr = (uintptr_t) getbuf(ring, bid);
+    buf->len = NRbufsize;
+    buf->bid = bid;
+    __atomic_store_n(&ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool
+uring_armaccept(struct netring *ring, struct rop *op)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = op->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = ((op->flags & NDblocking) ? 0 : SOCK_NONBLOCK) |
+                        ((op->flags & NDexeckeep) ? 0 : SOCK_CLOEXEC);
+    sqe->user_data = (uintptr_t) op;
+    return true;
+}
+
+static bool
+uring_armrecv(struct netring *ring, struct rop *op)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = op->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NRbufgroup;
+    sqe->user_data = (uintptr_t) op;
+    return true;
+}
+
+static bool
+uring_armwakeup(struct netring *ring)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->wakefd;
+    sqe->addr = (uintptr_t) &ring->wakevalue;
+    sqe->len = sizeof(ring->wakevalue);
+    sqe->user_data = (uintptr_t) ring->wakeop;
+    return true;
+}
+
+static void
+uring_close(struct netring *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqentries * sizeof(struct io_uring_sqe));
+    if (ring->cqmap && ring->cqmap != ring->sqmap)
+        munmap(ring->cqmap, ring->cqmapsize);
+    if (ring->sqmap)
+        munmap(ring->sqmap, ring->sqmapsize);
+    if (ring->br)
+        munmap(ring->br, ring->brsize);
+    if (ring->ringfd != -1)
+        close(ring->ringfd);
+}
+
+/*
+ * Multishot receives need Linux 6.0, older versions fail them with EINVAL
+ * while still having multishot accepts and provided buffer rings (5.19).
+ * Try one on a socket which reaches end of file right away, before adding
+ * buffers to the ring, so none gets used.
+ */
+static bool
+uring_probe(struct netring *ring)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+        return false;
+    close(fds[1]);
+
+    bool supported = false;
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fds[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = NRbufgroup;
+
+        if (uring_submit(ring, 1) == 1) {
+            const unsigned head = *ring->cqhead;
+            if (head != __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE)) {
+                supported = ring->cqes[head & *ring->cqmask].res != -EINVAL;
+                __atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    close(fds[0]);
+    if (!supported)
+        errno = ENOTSUP;
+    return supported;
+}
+
+static bool
+uring_init(struct netring *ring)
+{
+    struct io_uring_params p = {};
+    if ((ring->ringfd = uring_setup(NRentries, &p)) == -1)
+        return false;
+
+    /* Requires at least Linux 6.0 for multishot receives, see uring_probe(). */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    ring->sqmapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cqmapsize > ring->sqmapsize)
+        ring->sqmapsize = ring->cqmapsize;
+    ring->cqmapsize = ring->sqmapsize;
+
+    ring->sqmap = mmap(NULL, ring->sqmapsize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQ_RING);
+    if (ring->sqmap == MAP_FAILED) {
+        ring->sqmap = NULL;
+        return false;
+    }
+    ring->cqmap = ring->sqmap;
+
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ringfd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return false;
+    }
+
+    uint8_t *sq = ring->sqmap;
+    ring->sqhead = (unsigned*) (sq + p.sq_off.head);
+    ring->sqtail = (unsigned*) (sq + p.sq_off.tail);
+    ring->sqmask = (unsigned*) (sq + p.sq_off.ring_mask);
+    ring->sqarray = (unsigned*) (sq + p.sq_off.array);
+    ring->sqentries = p.sq_entries;
+    ring->sqlocaltail = ring->sqsubmitted = *ring->sqtail;
+
+    uint8_t *cq = ring->cqmap;
+    ring->cqhead = (unsigned*) (cq + p.cq_off.head);
+    ring->cqtail = (unsigned*) (cq + p.cq_off.tail);
+    ring->cqmask = (unsigned*) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    ring->brsize = NRbufcount * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->brsize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED) {
+        ring->br = NULL;
+        return false;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t) ring->br,
+        .ring_entries = NRbufcount,
+        .bgid = NRbufgroup,
+    };
+    if (uring_register(ring->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) ||
+        !uring_probe(ring))
+        return false;
+
+    for (unsigned i = 0; i < NRbufcount; i++)
+        uring_recyclebuf(ring, i);
+
+    if (!(ring->wakeop = mkop(ring, OPwakeup, ring->wakefd, 0)))
+        return false;
+
+    return uring_armwakeup(ring);
+}
+
+static bool
+transienterr(int err)
+{
+    switch (err) {
+        case EAGAIN:
+        case ECONNABORTED:
+        case EINTR:
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+uring_complete(struct netring *ring, const struct io_uring_cqe *cqe)
+{
+    struct rop *op = (struct rop*) (uintptr_t) cqe->user_data;
+    if (!op)
+        return;
+
+    const bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (op->kind) {
+        case OPwakeup:
+            ring->stop = true;
+            uring_armwakeup(ring);
+            break;
+
+        case OPaccept:
+            if (!op->cancelled) {
+                if (cqe->res < 0)
+                    errno = -cqe->res;
+                (*op->fn.accept)(ring, (cqe->res < 0) ? -1 : cqe->res, op->data);
+            } else if (cqe->res >= 0) {
+                close(cqe->res);
+            }
+            if (!more) {
+                if (!op->cancelled && (cqe->res >= 0 || transienterr(-cqe->res)) &&
+                    uring_armaccept(ring, op))
+                    break;
+                if (!op->cancelled)
+                    ring->fds[op->fd].accept = NULL;
+                freeop(op);
+            }
+            break;
+
+        case OPrecv: {
+            const bool hasbuf = cqe->flags & IORING_CQE_F_BUFFER;
+            const unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            /* Running out of buffers ends multishot receives, but is not fatal. */
+            const bool rearm = !more && !op->cancelled &&
+                (cqe->res > 0 || cqe->res == -ENOBUFS);
+
+            if (!more && !rearm && !op->cancelled)
+                ring->fds[op->fd].recv = NULL;
+
+            if (!op->cancelled && cqe->res != -ENOBUFS) {
+                if (cqe->res < 0)
+                    errno = -cqe->res;
+                (*op->fn.recv)(ring, op->fd,
+                               hasbuf ? getbuf(ring, bid) : NULL,
+                               (cqe->res < 0) ? -1 : cqe->res,
+                               op->data);
+            }
+
+            if (hasbuf)
+                uring_recyclebuf(ring, bid);
+
+            if (more)
+                break;
+
+            /* The callback may have cancelled the operation. */
+            if (rearm && !op->cancelled) {
+                if (uring_armrecv(ring, op))
+                    break;
+                ring->fds[op->fd].recv = NULL;
+            }
+            freeop(op);
+            break;
+        }
+
+        case OPsend:
+            if (cqe->res < 0) {
+                if (!op->err)
+                    op->err = -cqe->res;
+            } else {
+                op->total += cqe->res;
+            }
+            if (--op->pending == 0) {
+                if (op->err)
+                    errno = op->err;
+                (*op->fn.send)(ring, op->fd, op->err ? -1 : op->total, op->data);
+                freeop(op);
+            }
+            break;
+    }
+}
+
+static int
+uring_run(struct netring *ring)
+{
+    while (!ring->stop) {
+        if (uring_submit(ring, 1) == -1 && errno != EINTR &&
+            errno != EBUSY && errno != EAGAIN)
+            return -1;
+
+        unsigned head = *ring->cqhead;
+        const unsigned tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe cqe = ring->cqes[head & *ring->cqmask];
+            uring_complete(ring, &cqe);
+        }
+        __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static int
+uring_cancel(struct netring *ring, int fd)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe)
+        return -1;
+
+    /* Completions with a zero user_data are ignored. */
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    return 0;
+}
+
+/*
+ * Epoll backend, built on top of netloop.
+ */
+
+static void epoll_ready(struct netloop*, int, int, void*);
+
+static bool
+epoll_watch(struct netring *ring, int fd)
+{
+    struct fdstate *st = &ring->fds[fd];
+    if (st->watched)
+        return true;
+
+    if (netloop_add(ring->loop, fd, NLread | NLwrite, epoll_ready, ring) == -1)
+        return false;
+
+    st->watched = true;
+    return true;
+}
+
+static void
+epoll_unwatch(struct netring *ring, int fd)
+{
+    struct fdstate *st = &ring->fds[fd];
+    if (st->watched && !st->recv && !st->sendq) {
+        netloop_del(ring->loop, fd);
+        st->watched = false;
+    }
+}
+
+static void
+epoll_flush(struct netring *ring, int fd)
+{
+    struct rop *op;
+    while ((op = ring->fds[fd].sendq)) {
+        const ssize_t r = writev(fd, op->iov + op->iovpos, op->iovcnt - op->iovpos);
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (r >= 0) {
+            op->total += r;
+
+            size_t n = r;
+            while (op->iovpos < op->iovcnt && n >= op->iov[op->iovpos].iov_len)
+                n -= op->iov[op->iovpos++].iov_len;
+
+            if (op->iovpos < op->iovcnt) {
+                /* Partially written, continue from where it was left. */
+                struct iovec *v = &op->iov[op->iovpos];
+                v->iov_base = (uint8_t*) v->iov_base + n;
+                v->iov_len -= n;
+                continue;
+            }
+        }
+
+        const int err = errno;
+        if (!(ring->fds[fd].sendq = op->qnext))
+            ring->fds[fd].sendqtail = NULL;
+
+        errno = err;
+        (*op->fn.send)(ring, fd, (r == -1) ? -1 : op->total, op->data);
+        freeop(op);
+    }
+}
+
+static void
+epoll_recv(struct netring *ring, int fd)
+{
+    struct rop *op;
+    while ((op = ring->fds[fd].recv)) {
+        uint8_t *buf = getbuf(ring, 0);
+        const ssize_t r = read(fd, buf, NRbufsize);
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (r <= 0)
+            ring->fds[fd].recv = NULL;
+
+        (*op->fn.recv)(ring, fd, (r > 0) ? buf : NULL, r, op->data);
+
+        if (r <= 0) {
+            freeop(op);
+            return;
+        }
+    }
+}
+
+static void
+epoll_ready(struct netloop *loop, int fd, int events, void *data)
+{
+    struct netring *ring = data;
+
+    (void) loop;
+
+    if (events & (NLread | NLerror))
+        epoll_recv(ring, fd);
+    if (events & (NLwrite | NLerror))
+        epoll_flush(ring, fd);
+
+    epoll_unwatch(ring, fd);
+}
+
+static void
+epoll_accepted(struct netloop *loop, int fd,
+               const struct sockaddr_storage *remoteaddr, void *data)
+{
+    struct rop *op = data;
+
+    (void) loop;
+    (void) remoteaddr;
+
+    (*op->fn.accept)(op->ring, fd, op->data);
+}
+
+static void
+epoll_stopped(struct netloop *loop, int fd, int events, void *data)
+{
+    struct netring *ring = data;
+    uint64_t value;
+
+    (void) events;
+
+    if (read(fd, &value, sizeof(value)) == -1)
+        return;
+
+    ring->stop = true;
+    netloop_stop(loop);
+}
+
+/*
+ * Public API.
+ */
+
+struct netring*
+netring_new(int flags)
+{
+    struct netring *ring = calloc(1, sizeof(struct netring));
+    if (!ring)
+        return NULL;
+
+    ring->ringfd = ring->wakefd = -1;
+    /* Blocking, io_uring would complete reads right away otherwise. */
+    if ((ring->wakefd = eventfd(0, EFD_CLOEXEC)) == -1)
+        goto beach;
+
+    ring->bufs = mmap(NULL, (size_t) NRbufcount * NRbufsize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED) {
+        ring->bufs = NULL;
+        goto beach;
+    }
+
+    if (!(flags & NRepoll)) {
+        if (uring_init(ring)) {
+            ring->uring = true;
+            return ring;
+        }
+
+        /* Fall back to epoll when io_uring is unavailable. */
+        uring_close(ring);
+        ring->sqes = NULL;
+        ring->sqmap = ring->cqmap = NULL;
+        ring->br = NULL;
+        ring->ringfd = -1;
+        while (ring->ops)
+            freeop(ring->ops);
+    }
+
+    if (!(ring->loop = netloop_new()))
+        goto beach;
+
+    if (netloop_add(ring->loop, ring->wakefd, NLread, epoll_stopped, ring) == -1)
+        goto beach;
+
+    return ring;
+
+beach: {
+        const int err = errno;
+        netring_free(ring);
+        errno = err;
+        return NULL;
+    }
+}
+
+void
+netring_free(struct netring *ring)
+{
+    assert(ring);
+
+    if (ring->uring)
+        uring_close(ring);
+    if (ring->loop)
+        netloop_free(ring->loop);
+    while (ring->ops)
+        freeop(ring->ops);
+    if (ring->bufs)
+        munmap(ring->bufs, (size_t) NRbufcount * NRbufsize);
+    if (ring->wakefd != -1)
+        close(ring->wakefd);
+    free(ring->fds);
+    free(ring);
+}
+
+const char*
+netring_backend(const struct netring *ring)
+{
+    assert(ring);
+    return ring->uring ? "io_uring" : "epoll";
+}
+
+int
+netring_run(struct netring *ring)
+{
+    assert(ring);
+
+    ring->stop = false;
+    return ring->uring ? uring_run(ring) : netloop_run(ring->loop);
+}
+
+void
+netring_stop(struct netring *ring)
+{
+    assert(ring);
+
+    /* Safe to use from signal handlers and other threads. */
+    const uint64_t value = 1;
+    while (write(ring->wakefd, &value, sizeof(value)) == -1 && errno == EINTR)
+        ;
+}
+
+int
+netring_accept(struct netring *ring, int fd, int flags,
+               netring_acceptfn fn, void *data)
+{
+    assert(ring);
+    assert(fn);
+
+    struct fdstate *st = getfdstate(ring, fd);
+    if (!st)
+        return -1;
+    if (st->accept || st->recv) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    struct rop *op = mkop(ring, OPaccept, fd, 0);
+    if (!op)
+        return -1;
+
+    op->flags = flags;
+    op->fn.accept = fn;
+    op->data = data;
+
+    const bool ok = ring->uring
+        ? uring_armaccept(ring, op)
+        : netloop_accept(ring->loop, fd, flags, epoll_accepted, op) == 0;
+    if (!ok) {
+        const int err = errno;
+        freeop(op);
+        errno = err;
+        return -1;
+    }
+
+    ring->fds[fd].accept = op;
+    return 0;
+}
+
+int
+netring_recv(struct netring *ring, int fd, netring_recvfn fn, void *data)
+{
+    assert(ring);
+    assert(fn);
+
+    struct fdstate *st = getfdstate(ring, fd);
+    if (!st)
+        return -1;
+    if (st->accept || st->recv) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    struct rop *op = mkop(ring, OPrecv, fd, 0);
+    if (!op)
+        return -1;
+
+    op->fn.recv = fn;
+    op->data = data;
+
+    const bool ok = ring->uring ? uring_armrecv(ring, op) : epoll_watch(ring, fd);
+    if (!ok) {
+        const int err = errno;
+        freeop(op);
+        errno = err;
+        return -1;
+    }
+
+    ring->fds[fd].recv = op;
+
+    /* Data may be available already, and no edge would be seen. */
+    if (!ring->uring)
+        epoll_recv(ring, fd);
+    return 0;
+}
+
+int
+netring_send(struct netring *ring, int fd,
+             const struct iovec *iov, unsigned iovcnt,
+             netring_sendfn fn, void *data)
+{
+    assert(ring);
+    assert(fn);
+
+    if (!iov || !iovcnt || iovcnt > NRmaxiov) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct fdstate *st = getfdstate(ring, fd);
+    if (!st)
+        return -1;
+
+    if (ring->uring && !uring_reserve(ring, iovcnt))
+        return -1;
+
+    struct rop *op = mkop(ring, OPsend, fd, iovcnt);
+    if (!op)
+        return -1;
+
+    op->fn.send = fn;
+    op->data = data;
+    op->iovcnt = iovcnt;
+    memcpy(op->iov, iov, iovcnt * sizeof(struct iovec));
+
+    if (ring->uring) {
+        /* Linked so they are executed in order, a failure cancels the rest. */
+        for (unsigned i = 0; i < iovcnt; i++) {
+            struct io_uring_sqe *sqe = uring_sqe(ring);
+            assert(sqe);
+
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t) iov[i].iov_base;
+            sqe->len = iov[i].iov_len;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->flags = (i + 1 < iovcnt) ? IOSQE_IO_LINK : 0;
+            sqe->user_data = (uintptr_t) op;
+        }
+        op->pending = iovcnt;
+        return 0;
+    }
+
+    if (!epoll_watch(ring, fd)) {
+        const int err = errno;
+        freeop(op);
+        errno = err;
+        return -1;
+    }
+
+    if (st->sendqtail)
+        st->sendqtail->qnext = op;
+    else
+        st->sendq = op;
+    st->sendqtail = op;
+
+    epoll_flush(ring, fd);
+    epoll_unwatch(ring, fd);
+    return 0;
+}
+
+int
+netring_cancel(struct netring *ring, int fd)
+{
+    assert(ring);
+
+    if (fd < 0 || (unsigned) fd >= ring->nfds) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    struct fdstate *st = &ring->fds[fd];
+    if (st->accept)
+        st->accept->cancelled = true;
+    if (st->recv)
+        st->recv->cancelled = true;
+
+    if (ring->uring) {
+        /* Operations are released once their last completion arrives. */
+        st->accept = st->recv = NULL;
+        return uring_cancel(ring, fd);
+    }
+
+    if (st->accept) {
+        netloop_del(ring->loop, fd);
+        freeop(st->accept);
+        st->accept = NULL;
+    }
+
+    if (st->recv) {
+        freeop(st->recv);
+        st->recv = NULL;
+    }
+
+    while (st->sendq) {
+        struct rop *op = st->sendq;
+        st->sendq = op->qnext;
+        errno = ECANCELED;
+        (*op->fn.send)(ring, fd, -1, op->data);
+        freeop(op);
+    }
+    st->sendqtail = NULL;
+
+    epoll_unwatch(ring, fd);
+    return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * netring.h
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef NETRING_H
+#define NETRING_H
+
+#include <sys/types.h>
+
+struct iovec;
+struct netring;
+
+enum {
+    NRdefault = 0,
+    NRepoll   = 1 << 0,  /* Do not use io_uring. */
+};
+
+enum {
+    /* Maximum amount of buffers for netring_send(). */
+    NRmaxiov = 64,
+};
+
+typedef void (*netring_acceptfn)(struct netring *ring, int fd, void *data);
+typedef void (*netring_recvfn)(struct netring *ring, int fd,
+                               const void *buf, ssize_t len, void *data);
+typedef void (*netring_sendfn)(struct netring *ring, int fd, ssize_t len, void *data);
+
+extern struct netring* netring_new(int flags);
+extern void netring_free(struct netring *ring);
+extern const char* netring_backend(const struct netring *ring);
+extern int netring_run(struct netring *ring);
+extern void netring_stop(struct netring *ring);
+
+extern int netring_accept(struct netring *ring, int fd, int flags,
+                          netring_acceptfn fn, void *data);
+extern int netring_recv(struct netring *ring, int fd, netring_recvfn fn, void *data);
+extern int netring_send(struct netring *ring, int fd,
+                        const struct iovec *iov, unsigned iovcnt,
+                        netring_sendfn fn, void *data);
+extern int netring_cancel(struct netring *ring, int fd);
+
+#endif /* !NETRING_H */
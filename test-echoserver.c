@@ -5,101 +5,39 @@
  * Distributed under terms of the MIT license.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "netdial.h"
+#include "netio.h"
+#include "netloop.h"
 #include <assert.h>
 #include <errno.h>
-#include <event.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 enum {
     Chunksize = 1024U,
-};
 
-struct chunk {
-    uint8_t       buf[Chunksize];
-    size_t        len;
-    size_t        off;
-    struct chunk *next;
+    /* Stop reading from clients which do not read the echoed data. */
+    Lowat = 64 * 1024U,
+    Hiwat = 256 * 1024U,
 };
 
-struct chunkq {
-    struct chunk *head;
-    struct chunk *tail;
-};
-
-static struct chunk*
-mkchunk(void)
-{
-    struct chunk *c = malloc(sizeof(struct chunk));
-    c->len = c->off = 0;
-    c->next = NULL;
-    return c;
-}
-
-static void
-freechunk(struct chunk **c)
-{
-    assert(c);
-    free(*c);
-    c = NULL;
-}
-
-static void
-pushchunk(struct chunkq *q, struct chunk *c)
-{
-    assert(q);
-    assert(c);
-
-    if (q->tail) {
-        assert(q->tail->next == NULL);
-        assert(c->next == NULL);
-
-        q->tail->next = c;
-        q->tail = c;
-    } else {
-        assert(q->head == NULL);
-
-        q->head = q->tail = c;
-    }
-}
-
-static struct chunk*
-popchunk(struct chunkq *q)
-{
-    assert(q);
-    assert(q->head);
-
-    struct chunk *c = q->head;
-    q->head = q->head->next;
-    return c;
-}
-
-static struct chunk*
-firstchunk(struct chunkq *q)
-{
-    assert(q);
-    assert(q->head);
-    return q->head;
-}
+static bool verbose = false;
 
-static bool
-haschunk(const struct chunkq* q)
-{
-    assert(q);
-    return q->head != NULL;
-}
+#define LOG(...) \
+    do { if (verbose) fprintf(stderr, __VA_ARGS__); } while (0)
 
 struct conn {
-    struct event  rev;
-    struct event  wev;
-    struct chunkq chunks;
-    size_t        nbytes;
+    struct ndwq *wq;
+    size_t       nbytes;
+    bool         paused;
 };
 
 static void
@@ -107,212 +45,203 @@ freeconn(struct conn **conn)
 {
     assert(conn);
 
-    event_del(&(*conn)->rev);
-    while (haschunk(&(*conn)->chunks)) {
-        struct chunk *c = popchunk(&(*conn)->chunks);
-        freechunk(&c);
-    }
+    if ((*conn)->wq)
+        ndwq_free((*conn)->wq);
 
     free(*conn);
     conn = NULL;
 }
 
 static void
-handle_conn_read(int fd, short events, void *data)
+closeconn(struct netloop *loop, int fd, struct conn *conn)
 {
-    struct conn *conn = data;
+    netloop_del(loop, fd);
+    freeconn(&conn);
+    nethangup(fd, NDclose);
+}
 
-    for (;;) {
-        /* Try to read as many chunks as possible before blocking. */
-        fprintf(stderr,
-                "[#%d] Attempting to read %u bytes.\n",
-                fd, Chunksize);
+static bool
+handle_conn_read(int fd, struct conn *conn)
+{
+    /* Edge-triggered: read as much as possible before blocking. */
+    while (!ndwq_full(conn->wq)) {
+        LOG("[#%d] Attempting to read %u bytes.\n", fd, Chunksize);
 
-        struct chunk *c = mkchunk();
-        ssize_t r = read(fd, c->buf, Chunksize);
+        uint8_t buf[Chunksize];
+        ssize_t r = read(fd, buf, sizeof(buf));
         if (r == 0) {
             /* Client disconnected. */
-            fprintf(stderr,
-                    "[#%d] Closed, exchanged %zu bytes.\n",
-                    fd, conn->nbytes);
-            freechunk(&c);
-            freeconn(&conn);
-            nethangup(fd, NDclose);
-            return;
+            LOG("[#%d] Closed, exchanged %zu bytes.\n", fd, conn->nbytes);
+            return false;
         }
 
         if (r == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                fprintf(stderr,
-                        "[#%d] Not ready, will read later.\n",
-                        fd);
-                break;
+                LOG("[#%d] Not ready, will read later.\n", fd);
+                return true;
             }
 
-            fprintf(stderr,
-                    "[#%d] Closed, read error: %s.\n",
-                    fd, strerror(errno));
-            freechunk(&c);
-            freeconn(&conn);
-            nethangup(fd, NDclose);
-            return;
+            LOG("[#%d] Closed, read error: %s.\n", fd, strerror(errno));
+            return false;
         }
 
-        fprintf(stderr, "[#%d] Read %zd bytes.\n", fd, r);
-        c->len = r;
-        pushchunk(&conn->chunks, c);
-
-        if (r < Chunksize) {
-            fprintf(stderr,
-                    "[#%d] Short read, will read later.\n",
-                    fd);
-            break;
+        LOG("[#%d] Read %zd bytes.\n", fd, r);
+        if (ndwq_add(conn->wq, buf, r) == -1) {
+            LOG("[#%d] Closed, cannot queue data: %s.\n", fd, strerror(errno));
+            return false;
         }
     }
 
-    /* Schedule writing. */
-    if (haschunk(&conn->chunks))
-        event_add(&conn->wev, NULL);
+    /* Input is left unread, and there will be no edge for it. */
+    LOG("[#%d] Pausing reading.\n", fd);
+    conn->paused = true;
+    return true;
 }
 
-static void
-handle_conn_write(int fd, short events, void *data)
+static bool
+handle_conn_write(int fd, struct conn *conn)
 {
-    struct conn *conn = data;
+    if (!ndwq_pending(conn->wq))
+        return true;
 
-    while (haschunk(&conn->chunks)) {
-        struct chunk *c = firstchunk(&conn->chunks);
-        assert(c->len - c->off > 0);
-        size_t n = c->len - c->off;
+    LOG("[#%d] Attempting to write %zu bytes.\n", fd, ndwq_pending(conn->wq));
 
-        fprintf(stderr,
-                "[#%d] Attempting to write %zu bytes.\n",
-                fd, n);
-
-        ssize_t r = write(fd, c->buf + c->off, n);
+    ssize_t r = ndwq_flush(conn->wq, fd);
+    if (r == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* Try again when writable. */
+            return true;
+        }
 
-        if (r == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                /* Try again later. */
-                event_add(&conn->wev, NULL);
-                return;
-            }
+        LOG("[#%d] Closed, write error: %s.\n", fd, strerror(errno));
+        return false;
+    }
 
-            fprintf(stderr,
-                    "[#%d] Closed, read error: %s.\n",
-                    fd, strerror(errno));
-            freechunk(&c);
-            freeconn(&conn);
-            nethangup(fd, NDclose);
-            return;
-        }
+    LOG("[#%d] Wrote %zd bytes, %zu pending.\n", fd, r, ndwq_pending(conn->wq));
+    conn->nbytes += r;
+    return true;
+}
 
-        fprintf(stderr,
-                "[#%d] Wrote %zd bytes, %zd pending.\n",
-                fd, r, n - r);
+static void
+handle_conn(struct netloop *loop, int fd, int events, void *data)
+{
+    struct conn *conn = data;
 
-        conn->nbytes += r;
+    if ((events & NLread) && !handle_conn_read(fd, conn)) {
+        closeconn(loop, fd, conn);
+        return;
+    }
 
-        if (r < n) {
-            /* Data pending to write. Update offset and reschedule. */
-            c->off += n;
-            event_add(&conn->wev, NULL);
-            return;
-        }
+    /* Echo back whatever was read, also when the socket becomes writable. */
+    if (!handle_conn_write(fd, conn) || (events & NLerror)) {
+        closeconn(loop, fd, conn);
+        return;
+    }
 
-        /* Chunk completely written. */
-        popchunk(&conn->chunks);
-        freechunk(&c);
+    /* Re-arming reports the input left unread once the queue drains. */
+    if (conn->paused && !ndwq_full(conn->wq)) {
+        LOG("[#%d] Resuming reading.\n", fd);
+        conn->paused = false;
+        if (netloop_mod(loop, fd, NLread | NLwrite) == -1)
+            closeconn(loop, fd, conn);
     }
 }
 
 static void
-handle_accept(int fd, short events, void *data)
+handle_accept(struct netloop *loop, int fd,
+              const struct sockaddr_storage *remoteaddr, void *data)
 {
-    struct event_base *evbase = data;
-
-    for (unsigned n = 0;; n++) {
-        char *remote = NULL;
-        int nfd = netaccept(fd, NDdefault, &remote);
-        if (nfd < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                fprintf(stderr, "[#%d] Accepted %u new connections.\n", fd, n);
-            } else {
-                fprintf(stderr, "[#%d] Netaccept: %s.\n", fd, strerror(errno));
-            }
-            break;
-        }
-
-        fprintf(stderr, "[#%d] New connection <%s>\n", nfd, remote);
-        free(remote);
+    (void) data;
 
-        struct conn *conn = calloc(1, sizeof(struct conn));
+    if (fd < 0) {
+        fprintf(stderr, "Netaccept: %s.\n", strerror(errno));
+        return;
+    }
 
-        event_set(&conn->rev, nfd, EV_READ | EV_PERSIST,
-                  handle_conn_read, conn);
-        event_base_set(evbase, &conn->rev);
+    if (verbose) {
+        char remote[NDaddrmax];
+        if (netaddrstr(remoteaddr, SOCK_STREAM, remote, sizeof(remote)) == -1)
+            strcpy(remote, "?");
+        fprintf(stderr, "[#%d] New connection <%s>\n", fd, remote);
+    }
 
-        event_set(&conn->wev, nfd, EV_WRITE,
-                  handle_conn_write, conn);
-        event_base_set(evbase, &conn->wev);
+    struct conn *conn = calloc(1, sizeof(struct conn));
+    if (!conn) {
+        fprintf(stderr, "[#%d] Cannot allocate: %s.\n", fd, strerror(errno));
+        nethangup(fd, NDclose);
+        return;
+    }
 
-        /* Start reading only. */
-        event_add(&conn->rev, NULL);
+    if (!(conn->wq = ndwq_new(Lowat, Hiwat)) ||
+        netloop_add(loop, fd, NLread | NLwrite, handle_conn, conn) == -1) {
+        fprintf(stderr, "[#%d] Cannot watch: %s.\n", fd, strerror(errno));
+        freeconn(&conn);
+        nethangup(fd, NDclose);
     }
 }
 
+static struct netloop *loop = NULL;
+
 static void
-handle_signal(int signum, short events, void *data)
+handle_signal(int signum)
 {
-    struct event *ev = data;
-
-    fprintf(stderr, "\rExiting gracefully...\n");
-    signal_del(ev);
-
-    event_base_loopexit(ev->ev_base, NULL);
+    (void) signum;
+    netloop_stop(loop);
 }
 
 int
 main(int argc, char *argv[])
 {
+    if (argc == 3 && strcmp(argv[1], "-v") == 0) {
+        verbose = true;
+        argv++;
+        argc--;
+    }
+
     if (argc != 2) {
-        fprintf(stderr, "Usage: %s <address>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-v] <address>\n", argv[0]);
         fprintf(stderr, "Example: %s tcp:localhost:echo\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    setenv("EVENT_SHOW_METHOD", "1", 1);
-
-    int fd = netannounce(argv[1], NDdefault, 0);
+    int fd = netannounce(argv[1], NDdefault, SOMAXCONN);
     if (fd < 0) {
         fprintf(stderr, "Cannot announce %s: %s.\n", argv[1], strerror(errno));
         return EXIT_FAILURE;
     }
 
-    struct event_base *evbase = event_init();
-    char *localaddr = NULL;
-    if (netaddress(fd, NDlocal, &localaddr) == -1) {
+    char localaddr[NDaddrmax];
+    if (netaddress_r(fd, NDlocal, localaddr, sizeof(localaddr)) == -1) {
         fprintf(stderr, "Cannot obtain local socket address: %s.\n", strerror(errno));
         nethangup(fd, NDclose);
         return EXIT_FAILURE;
     }
 
     fprintf(stderr, "[#%d] Listening on <%s>.\n", fd, localaddr);
-    free(localaddr);
-    localaddr = NULL;
 
-    struct event evaccept;
-    event_set(&evaccept, fd, EV_READ | EV_PERSIST, handle_accept, evbase);
-    event_base_set(evbase, &evaccept);
-    event_add(&evaccept, NULL);
+    if (!(loop = netloop_new())) {
+        fprintf(stderr, "Cannot create loop: %s.\n", strerror(errno));
+        nethangup(fd, NDclose);
+        return EXIT_FAILURE;
+    }
 
-    struct event evsignal;
-    signal_set(&evsignal, SIGINT, handle_signal, &evsignal);
-    event_base_set(evbase, &evaccept);
-    signal_add(&evsignal, NULL);
+    if (netloop_accept(loop, fd, NDdefault, handle_accept, NULL) == -1) {
+        fprintf(stderr, "Cannot accept connections: %s.\n", strerror(errno));
+        netloop_free(loop);
+        nethangup(fd, NDclose);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction sa = { .sa_handler = handle_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    netloop_run(loop);
+    fprintf(stderr, "\rExiting gracefully...\n");
 
-    event_base_dispatch(evbase);
-    event_base_free(evbase);
+    netloop_del(loop, fd);
+    netloop_free(loop);
 
     nethangup(fd, NDclose);
     return EXIT_SUCCESS;
@@ -0,0 +1,241 @@
+/*
+ * test-inherit.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "netdial.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef nelem
+#define nelem(v) (sizeof(v) / sizeof(v[0]))
+#endif /* !nelem */
+
+enum {
+    Nhandoff   = 150,  /* More than two batches of nethandoff(). */
+    Nactivated = 2,
+};
+
+static unsigned failures;
+
+static void
+check(bool ok, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s ", ok ? "ok  " : "FAIL");
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+
+    if (!ok)
+        failures++;
+}
+
+/* Both descriptors refer to the same socket. */
+static bool
+samesocket(int a, int b)
+{
+    struct stat sa, sb;
+    return fstat(a, &sa) == 0 && fstat(b, &sb) == 0 &&
+           sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static bool
+announce(char address[NDaddrmax], int *fd)
+{
+    if ((*fd = netannounce("tcp4:127.0.0.1:0", NDdefault, 0)) == -1 ||
+        netaddress_r(*fd, NDlocal, address, NDaddrmax) == -1) {
+        fprintf(stderr, "Cannot announce: %s.\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Sockets sent in several batches are all received, and adopted. */
+static void
+testhandoff(void)
+{
+    static char address[Nhandoff][NDaddrmax];
+    int fds[Nhandoff];
+    for (unsigned i = 0; i < Nhandoff; i++) {
+        if (!announce(address[i], &fds[i])) {
+            check(false, "handoff: announce #%u", i);
+            return;
+        }
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        check(false, "handoff: socketpair: %s", strerror(errno));
+        return;
+    }
+
+    check(nethandoff(sv[0], fds, Nhandoff) == 0, "nethandoff: %u sockets", Nhandoff);
+    const int n = netinherit(sv[1]);
+    check(n == Nhandoff, "netinherit: %d sockets", n);
+    close(sv[0]);
+    close(sv[1]);
+
+    /* The last one is left for netinheritflush(). */
+    unsigned adopted = 0;
+    for (unsigned i = 0; i < Nhandoff - 1; i++) {
+        const int fd = netannounce(address[i], NDinherit, 0);
+        if (fd != -1 && fd != fds[i] && samesocket(fd, fds[i]))
+            adopted++;
+        if (fd != -1)
+            close(fd);
+    }
+    check(adopted == Nhandoff - 1, "handoff: %u sockets adopted", adopted);
+
+    /* Not adopted, a new socket cannot bind the address in use. */
+    check(netannounce(address[0], NDinherit, 0) == -1 && errno == EADDRINUSE,
+          "handoff: adopted only once");
+
+    netinheritflush();
+    check(netannounce(address[Nhandoff - 1], NDinherit, 0) == -1 && errno == EADDRINUSE,
+          "netinheritflush: leftover socket dropped");
+
+    int group[2];
+    check(netannouncegroup("tcp4:127.0.0.1:0", NDinherit | NDcpusteer, 0, 2, group) == -1 &&
+          errno == EINVAL, "netannouncegroup: NDinherit with NDcpusteer rejected");
+
+    for (unsigned i = 0; i < Nhandoff; i++)
+        close(fds[i]);
+}
+
+/*
+ * Runs the program again with "fds" (or /dev/null, if NULL) starting at
+ * file descriptor 3, in the given mode. The "pid" is used as LISTEN_PID,
+ * with a "self" prefix replaced by the process ID of the child, and NULL
+ * leaving it unset.
+ */
+static int
+spawn(const char *argv0, const char *mode, const int *fds, const char *pid,
+      const char *arg1, const char *arg2)
+{
+    const pid_t child = fork();
+    if (child == -1)
+        return -1;
+
+    if (child == 0) {
+        int moved[Nactivated];
+        for (unsigned i = 0; i < Nactivated; i++) {
+            const int fd = fds ? fds[i] : open("/dev/null", O_RDONLY);
+            if ((moved[i] = fcntl(fd, F_DUPFD_CLOEXEC, 100)) == -1)
+                _exit(127);
+        }
+        for (unsigned i = 0; i < Nactivated; i++)
+            if (dup2(moved[i], 3 + i) == -1)
+                _exit(127);
+
+        char value[32];
+        snprintf(value, sizeof(value), "%d", Nactivated);
+        setenv("LISTEN_FDS", value, 1);
+        if (!pid) {
+            unsetenv("LISTEN_PID");
+        } else {
+            if (strncmp(pid, "self", 4) == 0) {
+                snprintf(value, sizeof(value), "%ld%s", (long) getpid(), pid + 4);
+                pid = value;
+            }
+            setenv("LISTEN_PID", pid, 1);
+        }
+
+        execl(argv0, argv0, mode, arg1, arg2, (char*) NULL);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(child, &status, 0) == -1)
+        if (errno != EINTR)
+            return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* Run in the spawned process: sockets at 3 and 4 are adopted. */
+static int
+activated(const char *address0, const char *address1)
+{
+    const int fd0 = netannounce(address0, NDinherit, 0);
+    const int fd1 = netannounce(address1, NDinherit, 0);
+    return (fd0 == 3 && fd1 == 4) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Run in the spawned process: descriptors which are not sockets for it stay open. */
+static int
+untouched(void)
+{
+    netinheritflush();
+    for (int fd = 3; fd < 3 + Nactivated; fd++) {
+        const int fl = fcntl(fd, F_GETFD);
+        if (fl == -1 || (fl & FD_CLOEXEC))
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void
+testactivation(const char *argv0)
+{
+    char address[Nactivated][NDaddrmax];
+    int fds[Nactivated];
+    for (unsigned i = 0; i < Nactivated; i++) {
+        if (!announce(address[i], &fds[i])) {
+            check(false, "activation: announce #%u", i);
+            return;
+        }
+    }
+
+    check(spawn(argv0, "activated", fds, "self", address[0], address[1]) == 0,
+          "LISTEN_FDS: sockets adopted");
+
+    static const struct {
+        const char *pid;
+        const char *name;
+    } ignored[] = {
+        { NULL,    "unset" },
+        { "1",     "of another process" },
+        { "",      "empty" },
+        { "-1",    "negative" },
+        { "selfx", "with trailing garbage" },
+    };
+    for (unsigned i = 0; i < nelem(ignored); i++) {
+        check(spawn(argv0, "untouched", NULL, ignored[i].pid, NULL, NULL) == 0,
+              "LISTEN_FDS ignored with LISTEN_PID %s", ignored[i].name);
+    }
+
+    for (unsigned i = 0; i < Nactivated; i++)
+        close(fds[i]);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "activated") == 0)
+        return activated(argv[2], argv[3]);
+    if (argc == 2 && strcmp(argv[1], "untouched") == 0)
+        return untouched();
+
+    testhandoff();
+    testactivation(argv[0]);
+
+    if (failures) {
+        fprintf(stderr, "%u checks failed.\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+/*
+ * test-timestamp.c
+ * Copyright (C) 2020 Adrian Perez de Castro <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "netdial.h"
+#include "netio.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef nelem
+#define nelem(v) (sizeof(v) / sizeof(v[0]))
+#endif /* !nelem */
+
+enum {
+    Ndatagrams = 4,
+    Pausems    = 5,
+};
+
+static unsigned failures;
+
+static void
+check(bool ok, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s ", ok ? "ok  " : "FAIL");
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+
+    if (!ok)
+        failures++;
+}
+
+/* Timestamps use the same clock. */
+static uint64_t
+realns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleeppause(void)
+{
+    struct timespec ts = { .tv_nsec = Pausems * 1000000 };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+/* Datagrams arrive in the queue when sent, and wait there for the pause. */
+static void
+testreceive(int server, int client)
+{
+    for (unsigned i = 0; i < Ndatagrams; i++) {
+        if (send(client, &i, sizeof(i), 0) == -1) {
+            check(false, "send #%u: %s", i, strerror(errno));
+            continue;
+        }
+        sleeppause();
+
+        unsigned n;
+        struct ndtstamp ts;
+        const ssize_t r = netrecvts(server, &n, sizeof(n), NULL, &ts);
+        const uint64_t now = realns();
+        if (r == -1) {
+            check(false, "netrecvts #%u: %s", i, strerror(errno));
+            continue;
+        }
+
+        check(r == sizeof(n) && n == i, "netrecvts #%u: datagram received", i);
+        check(ts.sw != 0, "netrecvts #%u: software timestamp", i);
+        check(ts.sw && now - ts.sw >= Pausems * 1000000,
+              "netrecvts #%u: queued for %.3f ms", i, (now - ts.sw) / 1e6);
+    }
+}
+
+/* Each datagram gets scheduled and sent, in order. */
+static void
+testtransmit(int client)
+{
+    struct ndtxstamp stamps[4 * Ndatagrams];
+    unsigned nstamps = 0;
+
+    while (nstamps < nelem(stamps)) {
+        const int r = nettsreap(client, stamps + nstamps, nelem(stamps) - nstamps);
+        if (r == -1) {
+            check(errno == EAGAIN || errno == EWOULDBLOCK,
+                  "nettsreap: %s", strerror(errno));
+            break;
+        }
+        nstamps += r;
+    }
+
+    const int kinds[] = { NDtxsched, NDtxsent };
+    for (unsigned k = 0; k < nelem(kinds); k++) {
+        uint32_t next = 0;
+        bool ordered = true, stamped = true;
+        for (unsigned i = 0; i < nstamps; i++) {
+            if (stamps[i].kind != kinds[k])
+                continue;
+            ordered = ordered && stamps[i].id == next++;
+            stamped = stamped && stamps[i].ts.sw != 0;
+        }
+        check(next == Ndatagrams && ordered && stamped,
+              "nettsreap: %u %s stamps with increasing ids", next,
+              kinds[k] == NDtxsched ? "NDtxsched" : "NDtxsent");
+    }
+}
+
+/* Errors are reported along with timestamps, instead of being dropped. */
+static void
+testerrors(int client)
+{
+    const int on = 1;
+    if (setsockopt(client, SOL_IP, IP_RECVERR, &on, sizeof(on)) == -1) {
+        check(false, "IP_RECVERR: %s", strerror(errno));
+        return;
+    }
+
+    /* The server is closed, the ICMP port unreachable comes back. */
+    const char byte = 0;
+    send(client, &byte, sizeof(byte), 0);
+    sleeppause();
+
+    struct nderrq msgs[8];
+    bool stamped = false, refused = false;
+    const int n = neterrqreap(client, msgs, nelem(msgs));
+    for (int i = 0; i < n; i++) {
+        stamped = stamped || msgs[i].kind == NDerrqtx;
+        refused = refused || (msgs[i].kind == NDerrqerror && msgs[i].err == ECONNREFUSED);
+    }
+    check(stamped, "neterrqreap: transmit timestamps");
+    check(refused, "neterrqreap: ECONNREFUSED");
+
+    send(client, &byte, sizeof(byte), 0);
+    sleeppause();
+
+    /* Timestamps come first, and the error is reported by the next call. */
+    struct ndtxstamp stamps[8];
+    const int nstamps = nettsreap(client, stamps, nelem(stamps));
+    check(nstamps > 0, "nettsreap: %d timestamps before the error", nstamps);
+    const int r = nettsreap(client, stamps, nelem(stamps));
+    const int err = errno;
+    check(r == -1 && err == ECONNREFUSED, "nettsreap: %s",
+          (r == -1) ? strerror(err) : "no error");
+    check(nettsreap(client, stamps, nelem(stamps)) == -1 && errno == EAGAIN,
+          "nettsreap: error reported once");
+}
+
+int
+main(void)
+{
+    const int server = netannounce("udp:127.0.0.1:0", NDtimestamp, 0);
+    if (server < 0) {
+        fprintf(stderr, "Cannot announce: %s.\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    char address[NDaddrmax];
+    if (netaddress_r(server, NDlocal, address, sizeof(address)) == -1) {
+        fprintf(stderr, "Cannot obtain local socket address: %s.\n", strerror(errno));
+        nethangup(server, NDclose);
+        return EXIT_FAILURE;
+    }
+
+    const int client = netdial(address, NDtimestamp);
+    if (client < 0) {
+        fprintf(stderr, "Cannot dial %s: %s.\n", address, strerror(errno));
+        nethangup(server, NDclose);
+        return EXIT_FAILURE;
+    }
+
+    testreceive(server, client);
+    testtransmit(client);
+
+    nethangup(server, NDclose);
+    testerrors(client);
+    nethangup(client, NDclose);
+
+    if (failures) {
+        fprintf(stderr, "%u checks failed.\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}